@@ -1,3 +1,5 @@
 #pragma once
 #include "ncc.h"
-#include "graph-cut.h"
\ No newline at end of file
+#include "graph-cut.h"
+#include "census.h"
+#include "sgm.h"
\ No newline at end of file
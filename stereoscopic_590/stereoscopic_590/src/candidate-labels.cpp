@@ -0,0 +1,174 @@
+#include "candidate-labels.h"
+#include "data-cost-table.h"
+#include "thread-pool.h"
+
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+void CandidateLabels::reset(int _min_d, int max_d, const Mat &current) {
+  rows = current.rows;
+  cols = current.cols;
+  min_d = _min_d;
+  num_d = max(0, max_d - min_d + 1);
+
+  row_labels.resize(rows);
+  for (vector<uchar> &labels : row_labels)
+    labels.clear();
+  starts.assign((size_t) rows * (cols + 1), 0);
+  row_counts.assign((size_t) rows * num_d, 0);
+}
+
+void CandidateLabels::add_pixel(int y, int x, vector<uchar> &keep, const Mat &current) {
+  int d = current.at<uchar>(y, x);
+  if (d >= min_d && d < min_d + num_d)
+    keep[d - min_d] = 1;
+
+  vector<uchar> &labels = row_labels[y];
+  int *counts = &row_counts[(size_t) y * num_d];
+  for (int i = 0; i < num_d; i++) {
+    if (!keep[i])
+      continue;
+    keep[i] = 0;
+    labels.push_back(min_d + i);
+    counts[i]++;
+  }
+  starts[(size_t) y * (cols + 1) + x + 1] = (int) labels.size();
+}
+
+void CandidateLabels::build(const Mat &left, const Mat &right, int _min_d, int max_d,
+    int k, int spread, int window, const Mat &current) {
+  reset(_min_d, max_d, current);
+
+  // Each band sums its first window from scratch, so keep bands a few
+  // windows tall while still leaving several bands per thread to steal
+  ThreadPool &pool = ThreadPool::shared();
+  int band = max(2 * window, rows / (4 * pool.concurrency()));
+  pool.parallel_for(rows, band,
+      [this, &left, &right, k, spread, window, &current](int begin, int end, int) {
+    build_rows(left, right, k, spread, window, current, begin, end);
+  });
+}
+
+void CandidateLabels::build_around(const Mat &coarse, int band, int _min_d, int max_d,
+    const Mat &current) {
+  reset(_min_d, max_d, current);
+
+  ThreadPool::shared().parallel_for(rows, 8, [this, &coarse, band, &current](int begin, int end, int) {
+    vector<uchar> keep(num_d, 0);
+    for (int y = begin; y < end; y++) {
+      int coarse_y = min(y / 2, coarse.rows - 1);
+      for (int x = 0; x < cols; x++) {
+        int coarse_x = min(x / 2, coarse.cols - 1);
+        // Right pixel x - d must be in the image
+        int hi_d = min(min_d + num_d - 1, x);
+
+        bool guessed = false;
+        for (int v = max(coarse_y - 1, 0); v <= min(coarse_y + 1, coarse.rows - 1); v++) {
+          const uchar *guess = coarse.ptr<uchar>(v);
+          for (int u = max(coarse_x - 1, 0); u <= min(coarse_x + 1, coarse.cols - 1); u++) {
+            if (guess[u] == 0)
+              continue;
+            guessed = true;
+            for (int d = max(2 * guess[u] - band, min_d); d <= min(2 * guess[u] + band, hi_d); d++)
+              keep[d - min_d] = 1;
+          }
+        }
+        if (!guessed)
+          for (int d = min_d; d <= hi_d; d++)
+            keep[d - min_d] = 1;
+
+        add_pixel(y, x, keep, current);
+      }
+    }
+  });
+}
+
+int CandidateLabels::count(int row_begin, int row_end, int d) const {
+  if (d < min_d || d >= min_d + num_d)
+    return 0;
+  int n = 0;
+  for (int y = row_begin; y < row_end; y++)
+    n += row_counts[(size_t) y * num_d + d - min_d];
+  return n;
+}
+
+/**
+ * For every disparity we keep, per column, the cost summed over the
+ * window rows around the current row, and slide it down a row at a time.
+ * Rows and columns past the border repeat the edge, and a right pixel
+ * left of the image is matched against the first column.
+ */
+void CandidateLabels::build_rows(const Mat &left, const Mat &right, int k, int spread,
+    int window, const Mat &current, int row_begin, int row_end) {
+  int r = window / 2;
+  vector<int> col_sums((size_t) num_d * cols, 0);
+  vector<int> best_cost((size_t) cols * k);
+  vector<int> best_d((size_t) cols * k);
+  vector<int> num_best(cols);
+  vector<uchar> keep(num_d, 0);
+
+  // Add the costs of image row y to the column sums, times sign
+  auto add_row = [&](int y, int sign) {
+    y = min(max(y, 0), rows - 1);
+    const Vec3b *l = left.ptr<Vec3b>(y);
+    const Vec3b *rt = right.ptr<Vec3b>(y);
+    for (int i = 0; i < num_d; i++) {
+      int d = min_d + i;
+      int *sums = &col_sums[(size_t) i * cols];
+      for (int x = 0; x < cols; x++) {
+        int dist = DataCostTable::distance(l[x], rt[max(x - d, 0)]);
+        sums[x] += sign * dist * dist;
+      }
+    }
+  };
+
+  for (int y = row_begin - r; y <= row_begin + r; y++)
+    add_row(y, 1);
+
+  for (int y = row_begin; y < row_end; y++) {
+    if (y > row_begin) {
+      add_row(y + r, 1);
+      add_row(y - r - 1, -1);
+    }
+
+    // The k cheapest disparities of every pixel, cheapest first
+    fill(num_best.begin(), num_best.end(), 0);
+    for (int i = 0; i < num_d; i++) {
+      int d = min_d + i;
+      const int *sums = &col_sums[(size_t) i * cols];
+      for (int x = d; x < cols; x++) {
+        int cost = 0;
+        for (int u = -r; u <= r; u++)
+          cost += sums[min(max(x + u, 0), cols - 1)];
+
+        int *bc = &best_cost[(size_t) x * k];
+        int *bd = &best_d[(size_t) x * k];
+        int n = num_best[x];
+        if (n == k && cost >= bc[k - 1])
+          continue;
+        int j = (n < k) ? n++ : k - 1;
+        for (; j > 0 && bc[j - 1] > cost; j--) {
+          bc[j] = bc[j - 1];
+          bd[j] = bd[j - 1];
+        }
+        bc[j] = cost;
+        bd[j] = d;
+        num_best[x] = n;
+      }
+    }
+
+    // Widen them by spread
+    for (int x = 0; x < cols; x++) {
+      const int *bd = &best_d[(size_t) x * k];
+      for (int j = 0; j < num_best[x]; j++) {
+        int lo = max(bd[j] - spread, max(min_d, 0));
+        int hi = min(bd[j] + spread, min(min_d + num_d - 1, x));
+        for (int d = lo; d <= hi; d++)
+          keep[d - min_d] = 1;
+      }
+      add_pixel(y, x, keep, current);
+    }
+  }
+}
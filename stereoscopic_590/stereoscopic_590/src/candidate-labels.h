@@ -0,0 +1,68 @@
+#pragma once
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+
+/**
+ * The disparities in [min_d, max_d] each left pixel of a stereo pair may
+ * take, always including the disparity it already has, if any.
+ *
+ * Each row keeps the labels of its pixels one after the other, sorted
+ * per pixel, and the number of pixels holding every label.
+ */
+class CandidateLabels {
+public:
+  /**
+   * Rank the labels of every pixel of a CV_8UC3 pair by the squared
+   * colour distance, as the graph cut measures it, summed over a window
+   * square around the pixel. A pixel keeps its k best and those within
+   * spread of them. current is the CV_8U disparity map the search
+   * starts from, 0 where a pixel is occluded.
+   */
+  void build(const cv::Mat &left, const cv::Mat &right, int min_d, int max_d,
+    int k, int spread, int window, const cv::Mat &current);
+
+  /**
+   * Keep the labels within band of twice the disparities of the pixel
+   * and its neighbours in coarse, a map of half the resolution of
+   * current. A pixel with all of those occluded (0) keeps every label.
+   */
+  void build_around(const cv::Mat &coarse, int band, int min_d, int max_d,
+    const cv::Mat &current);
+
+  /** Whether left pixel (x, y) may take disparity d */
+  bool contains(int y, int x, int d) const {
+    const uchar *l = row_labels[y].data();
+    const int *s = &starts[(size_t) y * (cols + 1) + x];
+    for (int i = s[0]; i < s[1] && l[i] <= d; i++)
+      if (l[i] == d)
+        return true;
+    return false;
+  }
+
+  /** Pixels of rows [row_begin, row_end) that may take disparity d */
+  int count(int row_begin, int row_end, int d) const;
+
+private:
+  int rows, cols;
+  int min_d, num_d;
+
+  /** Labels of each row, pixel after pixel */
+  std::vector<std::vector<uchar> > row_labels;
+  /** Per row, where the labels of each pixel start, and the end */
+  std::vector<int> starts;
+  /** Per row, the number of pixels holding each label */
+  std::vector<int> row_counts;
+
+  /** Set up empty rows of the size of current */
+  void reset(int min_d, int max_d, const cv::Mat &current);
+  /**
+   * Append the labels marked in keep, and the current one, to pixel
+   * (x, y), which follows the pixels before it in the row
+   */
+  void add_pixel(int y, int x, std::vector<uchar> &keep, const cv::Mat &current);
+
+  /** Rank the labels of rows [row_begin, row_end) */
+  void build_rows(const cv::Mat &left, const cv::Mat &right, int k, int spread,
+    int window, const cv::Mat &current, int row_begin, int row_end);
+};
@@ -0,0 +1,35 @@
+#include "census-kernels.h"
+
+/**
+ * Hamming distances with the popcnt instruction, which -mpopcnt makes
+ * the builtins compile to. Only called once census_kernels() has seen
+ * the CPU support it.
+ */
+
+static void hamming_add32(const uint32_t *a, const uint32_t *b, int *acc, int n) {
+  for (int m = 0; m < n; m++)
+    acc[m] += __builtin_popcount(a[m] ^ b[m]);
+}
+
+static void hamming_add64(const uint64_t *a, const uint64_t *b, int *acc, int n) {
+  for (int m = 0; m < n; m++)
+    acc[m] += __builtin_popcountll(a[m] ^ b[m]);
+}
+
+static void hamming_add_sub32(const uint32_t *a_in, const uint32_t *b_in,
+    const uint32_t *a_out, const uint32_t *b_out, int *acc, int n) {
+  for (int m = 0; m < n; m++)
+    acc[m] += __builtin_popcount(a_in[m] ^ b_in[m]) - __builtin_popcount(a_out[m] ^ b_out[m]);
+}
+
+static void hamming_add_sub64(const uint64_t *a_in, const uint64_t *b_in,
+    const uint64_t *a_out, const uint64_t *b_out, int *acc, int n) {
+  for (int m = 0; m < n; m++) {
+    acc[m] += __builtin_popcountll(a_in[m] ^ b_in[m])
+      - __builtin_popcountll(a_out[m] ^ b_out[m]);
+  }
+}
+
+extern const CensusKernels census_kernels_popcnt = {
+  "popcnt", hamming_add32, hamming_add64, hamming_add_sub32, hamming_add_sub64
+};
@@ -0,0 +1,90 @@
+#include "census-kernels.h"
+#include <atomic>
+
+using namespace std;
+
+/******************
+ * Scalar kernels *
+ ******************/
+
+/** Bit-parallel popcount, for CPUs without the instruction */
+static inline int popcount32(uint32_t x) {
+  x = x - ((x >> 1) & 0x55555555u);
+  x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+  x = (x + (x >> 4)) & 0x0f0f0f0fu;
+  return (x * 0x01010101u) >> 24;
+}
+
+static inline int popcount64(uint64_t x) {
+  return popcount32((uint32_t) x) + popcount32((uint32_t) (x >> 32));
+}
+
+static void hamming_add32(const uint32_t *a, const uint32_t *b, int *acc, int n) {
+  for (int m = 0; m < n; m++)
+    acc[m] += popcount32(a[m] ^ b[m]);
+}
+
+static void hamming_add64(const uint64_t *a, const uint64_t *b, int *acc, int n) {
+  for (int m = 0; m < n; m++)
+    acc[m] += popcount64(a[m] ^ b[m]);
+}
+
+static void hamming_add_sub32(const uint32_t *a_in, const uint32_t *b_in,
+    const uint32_t *a_out, const uint32_t *b_out, int *acc, int n) {
+  for (int m = 0; m < n; m++)
+    acc[m] += popcount32(a_in[m] ^ b_in[m]) - popcount32(a_out[m] ^ b_out[m]);
+}
+
+static void hamming_add_sub64(const uint64_t *a_in, const uint64_t *b_in,
+    const uint64_t *a_out, const uint64_t *b_out, int *acc, int n) {
+  for (int m = 0; m < n; m++)
+    acc[m] += popcount64(a_in[m] ^ b_in[m]) - popcount64(a_out[m] ^ b_out[m]);
+}
+
+extern const CensusKernels census_kernels_scalar = {
+  "scalar", hamming_add32, hamming_add64, hamming_add_sub32, hamming_add_sub64
+};
+
+/************
+ * Dispatch *
+ ************/
+
+#ifdef X86_KERNELS
+extern const CensusKernels census_kernels_popcnt;
+#endif
+
+/** The variant called name if the CPU runs it, else nullptr */
+static const CensusKernels* find_kernels(const string &name) {
+  if (name == "scalar")
+    return &census_kernels_scalar;
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+  if (name == "popcnt" && __builtin_cpu_supports("popcnt"))
+    return &census_kernels_popcnt;
+#endif
+  return nullptr;
+}
+
+static const CensusKernels& best_kernels() {
+  const CensusKernels *kernels = find_kernels("popcnt");
+  return kernels ? *kernels : census_kernels_scalar;
+}
+
+static atomic<const CensusKernels*> selected(nullptr);
+
+const CensusKernels& census_kernels() {
+  const CensusKernels *kernels = selected.load(memory_order_acquire);
+  if (!kernels) {
+    kernels = &best_kernels();
+    selected.store(kernels, memory_order_release);
+  }
+  return *kernels;
+}
+
+bool select_census_kernels(const string &name) {
+  const CensusKernels *kernels = (name == "auto") ? &best_kernels() : find_kernels(name);
+  if (!kernels)
+    return false;
+  selected.store(kernels, memory_order_release);
+  return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+/**
+ * Hamming distance loops of CensusDisparity, built with and without the
+ * popcnt instruction.
+ */
+struct CensusKernels {
+  const char *name;
+
+  /** acc[m] += popcount(a[m] ^ b[m]), for m < n */
+  void (*hamming_add32)(const uint32_t *a, const uint32_t *b, int *acc, int n);
+  void (*hamming_add64)(const uint64_t *a, const uint64_t *b, int *acc, int n);
+
+  /**
+   * acc[m] += popcount(a_in[m] ^ b_in[m]) - popcount(a_out[m] ^ b_out[m]),
+   * for m < n
+   */
+  void (*hamming_add_sub32)(const uint32_t *a_in, const uint32_t *b_in,
+    const uint32_t *a_out, const uint32_t *b_out, int *acc, int n);
+  void (*hamming_add_sub64)(const uint64_t *a_in, const uint64_t *b_in,
+    const uint64_t *a_out, const uint64_t *b_out, int *acc, int n);
+};
+
+/**
+ * The kernels CensusDisparity uses. The first call picks the popcnt
+ * variant if the CPU has the instruction.
+ */
+const CensusKernels& census_kernels();
+
+/**
+ * Use the variant called name ("scalar" or "popcnt"), or the best
+ * supported one for "auto". Returns false, leaving the choice alone, if
+ * the variant is not built in or the CPU does not support it.
+ */
+bool select_census_kernels(const std::string &name);
+
+/**
+ * The kernel for the descriptor width, for code templated on it
+ */
+inline void hamming_add(const CensusKernels &k,
+    const uint32_t *a, const uint32_t *b, int *acc, int n) {
+  k.hamming_add32(a, b, acc, n);
+}
+
+inline void hamming_add(const CensusKernels &k,
+    const uint64_t *a, const uint64_t *b, int *acc, int n) {
+  k.hamming_add64(a, b, acc, n);
+}
+
+inline void hamming_add_sub(const CensusKernels &k,
+    const uint32_t *a_in, const uint32_t *b_in,
+    const uint32_t *a_out, const uint32_t *b_out, int *acc, int n) {
+  k.hamming_add_sub32(a_in, b_in, a_out, b_out, acc, n);
+}
+
+inline void hamming_add_sub(const CensusKernels &k,
+    const uint64_t *a_in, const uint64_t *b_in,
+    const uint64_t *a_out, const uint64_t *b_out, int *acc, int n) {
+  k.hamming_add_sub64(a_in, b_in, a_out, b_out, acc, n);
+}
@@ -0,0 +1,193 @@
+#include "census.h"
+#include "census-kernels.h"
+#include "thread-pool.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+using namespace std;
+
+cv::Mat get_gray8(cv::Mat im) {
+  cv::Mat gray;
+  cv::cvtColor(im, gray, CV_BGR2GRAY);
+  gray.convertTo(gray, CV_8U);
+  return gray;
+}
+
+template <typename T>
+void census_transform(const cv::Mat &gray, int census_size, vector<T> &descriptors) {
+  int rows = gray.rows;
+  int cols = gray.cols;
+  int cr = census_size / 2;
+
+  descriptors.assign(rows * cols, 0);
+  ThreadPool::shared().parallel_for(rows - 2 * cr, 16,
+      [&gray, &descriptors, cols, cr](int begin, int end, int) {
+    for (int i = cr + begin; i < cr + end; i++) {
+      const uchar *center = gray.ptr<uchar>(i);
+      T *out = &descriptors[i * cols];
+
+      for (int j = cr; j < cols - cr; j++) {
+        T bits = 0;
+        for (int u = -cr; u <= cr; u++) {
+          const uchar *row = gray.ptr<uchar>(i + u);
+          for (int v = -cr; v <= cr; v++) {
+            if (u == 0 && v == 0)
+              continue;
+            bits = (bits << 1) | (row[j + v] < center[j]);
+          }
+        }
+        out[j] = bits;
+      }
+    }
+  });
+}
+
+template void census_transform(const cv::Mat &gray, int census_size, vector<uint32_t> &descriptors);
+template void census_transform(const cv::Mat &gray, int census_size, vector<uint64_t> &descriptors);
+
+/**
+ * For every disparity we keep, per column, the cost summed over the
+ * window_size rows around the current row and slide it down one row at a
+ * time, as the running-sum NCC does, then slide a window sum along the row.
+ */
+template <typename T>
+void CensusDisparity::match_rows(const vector<T> &left, const vector<T> &right,
+    int row_begin, int row_end, Scratch &s) {
+  int cols = pair->cols;
+  int cr = options.census_size / 2;
+  int r = (window_size - 1) / 2;
+  int margin = cr + r;
+
+  int min_d = min(pair->min_disparity_left, pair->min_disparity_right);
+  int max_d = max(pair->max_disparity_left, pair->max_disparity_right);
+  int num_d = max_d - min_d + 1;
+
+  const CensusKernels &kernels = census_kernels();
+
+  // The band sums its first window from zero
+  fill(s.col_sums.begin(), s.col_sums.begin() + num_d * cols, 0);
+
+  for (int i = row_begin; i < row_end; i++) {
+    fill(s.best_left.begin(), s.best_left.end(), numeric_limits<int>::max());
+    fill(s.best_d_left.begin(), s.best_d_left.end(), 0);
+    fill(s.best_right.begin(), s.best_right.end(), numeric_limits<int>::max());
+    fill(s.best_d_right.begin(), s.best_d_right.end(), 0);
+
+    for (int k = 0; k < num_d; k++) {
+      int d = min_d + k;
+      bool for_left = d >= pair->min_disparity_left && d <= pair->max_disparity_left;
+      bool for_right = d >= pair->min_disparity_right && d <= pair->max_disparity_right;
+
+      // Left columns c with descriptors at both c and c - d
+      int c_min = max(cr, cr + d);
+      int c_max = min(cols - cr, cols - cr + d);
+      if (c_max - c_min < window_size)
+        continue;
+
+      int *acc = &s.col_sums[k * cols + c_min];
+      int n = c_max - c_min;
+
+      if (i == row_begin) {
+        // First row of the band: sum the whole window
+        for (int y = i - r; y <= i + r; y++)
+          hamming_add(kernels, &left[y * cols + c_min], &right[y * cols + c_min - d], acc, n);
+      } else {
+        // Slide the window down by one row
+        int y_in = (i + r) * cols;
+        int y_out = (i - r - 1) * cols;
+        hamming_add_sub(kernels,
+          &left[y_in + c_min], &right[y_in + c_min - d],
+          &left[y_out + c_min], &right[y_out + c_min - d], acc, n);
+      }
+
+      // Slide the window along the row. Left pixel j matches right pixel j - d.
+      const int *col = &s.col_sums[k * cols];
+      int cost = 0;
+      for (int c = c_min; c < c_min + window_size; c++)
+        cost += col[c];
+
+      for (int j = c_min + r; j < c_max - r; j++) {
+        if (j > c_min + r)
+          cost += col[j + r] - col[j - r - 1];
+
+        if (for_left && cost < s.best_left[j]) {
+          s.best_left[j] = cost;
+          s.best_d_left[j] = d;
+        }
+        if (for_right && cost < s.best_right[j - d]) {
+          s.best_right[j - d] = cost;
+          s.best_d_right[j - d] = d;
+        }
+      }
+    }
+
+    uchar *out_left = pair->disparity_left.ptr<uchar>(i);
+    uchar *out_right = pair->disparity_right.ptr<uchar>(i);
+    for (int j = margin; j < cols - margin; j++) {
+      out_left[j] = s.best_d_left[j];
+      out_right[j] = s.best_d_right[j];
+    }
+    report_row(*pair, i);
+  }
+}
+
+template <typename T>
+void CensusDisparity::compute_census() {
+  vector<T> left, right;
+  census_transform(get_gray8(pair->left), options.census_size, left);
+  census_transform(get_gray8(pair->right), options.census_size, right);
+
+  int cr = options.census_size / 2;
+  int r = (window_size - 1) / 2;
+  int margin = cr + r;
+  int num_rows = pair->rows - 2 * margin;
+
+  int min_d = min(pair->min_disparity_left, pair->min_disparity_right);
+  int max_d = max(pair->max_disparity_left, pair->max_disparity_right);
+  int num_d = max_d - min_d + 1;
+  if (num_d <= 0 || num_rows <= 0)
+    return;
+
+  ThreadPool &pool = ThreadPool::shared();
+  scratch.resize(pool.concurrency());
+  for (Scratch &s : scratch) {
+    s.col_sums.assign(num_d * pair->cols, 0);
+    s.best_left.assign(pair->cols, 0);
+    s.best_d_left.assign(pair->cols, 0);
+    s.best_right.assign(pair->cols, 0);
+    s.best_d_right.assign(pair->cols, 0);
+  }
+
+  // Each band sums its first window from scratch, so keep bands a few
+  // windows tall while still leaving several bands per thread to steal
+  int band = max(2 * window_size, num_rows / (4 * pool.concurrency()));
+  pool.parallel_for(num_rows, band,
+      [this, &left, &right, margin](int begin, int end, int worker) {
+    match_rows(left, right, margin + begin, margin + end, scratch[worker]);
+  });
+}
+
+CensusDisparity& CensusDisparity::compute(StereoPair &_pair) {
+  pair = &_pair;
+  report_start(*pair);
+
+  pair->disparity_left = cv::Mat(pair->rows, pair->cols, CV_8U);
+  pair->disparity_right = cv::Mat(pair->rows, pair->cols, CV_8U);
+
+  pair->disparity_left.setTo(0);
+  pair->disparity_right.setTo(0);
+
+  // Every neighbour but the centre takes a bit
+  if (options.census_size * options.census_size - 1 <= 32) {
+    compute_census<uint32_t>();
+  } else {
+    compute_census<uint64_t>();
+  }
+
+  if (options.left_right_check)
+    pair->check_left_right();
+
+  return *this;
+}
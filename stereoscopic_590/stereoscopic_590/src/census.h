@@ -0,0 +1,74 @@
+#pragma once
+#include "disparity-algorithm.h"
+#include <vector>
+
+/** 8-bit gray version of a colour image */
+cv::Mat get_gray8(cv::Mat im);
+
+/**
+ * Census descriptor of every pixel of an 8-bit gray image, row by row:
+ * one bit per neighbour in the census_size square, set when the
+ * neighbour is darker than the centre. Pixels too close to the border to
+ * have a full square get 0. T is uint32_t for squares up to 5 and
+ * uint64_t up to 7.
+ */
+template <typename T>
+void census_transform(const cv::Mat &gray, int census_size, std::vector<T> &descriptors);
+
+struct CensusOptions {
+  /**
+   * Side of the square the census transform compares each pixel with.
+   * Descriptors pack into 32 bits up to 5 and into 64 bits up to 7.
+   */
+  int census_size = 5;
+
+  /**
+   * Mark pixels occluded (0) when the other map does not send them back
+   * to within one disparity of where they started
+   */
+  bool left_right_check = false;
+};
+
+/**
+ * Matches census transforms of the 8-bit gray images. The cost of a
+ * match is the number of differing descriptor bits, summed over a
+ * window_size square.
+ *
+ * The census transform only keeps the order of the intensities, so it
+ * does not mind the illumination and exposure changes between the
+ * views. Each descriptor fits in one 32 or 64-bit word, so comparing two
+ * takes a single popcount.
+ */
+class CensusDisparity : public DisparityAlgorithm {
+private:
+  StereoPair *pair;
+  int window_size;
+  CensusOptions options;
+
+  /** Buffers owned by one pool worker, sized once per compute */
+  struct Scratch {
+    /** Per disparity and column, the cost summed over the window rows */
+    std::vector<int> col_sums;
+    /** Lowest cost and its disparity so far, per column of each map */
+    std::vector<int> best_left, best_d_left;
+    std::vector<int> best_right, best_d_right;
+  };
+  std::vector<Scratch> scratch;
+
+  /**
+   * Winner-take-all disparities of rows [row_begin, row_end) of both
+   * maps. The cost of left pixel x at disparity d is the cost of right
+   * pixel x - d, so both maps come out of one pass over the costs.
+   */
+  template <typename T>
+  void match_rows(const std::vector<T> &left, const std::vector<T> &right,
+    int row_begin, int row_end, Scratch &s);
+
+  template <typename T>
+  void compute_census();
+
+public:
+  CensusDisparity(int _window_size, CensusOptions _options = CensusOptions()) :
+    window_size(_window_size), options(_options) {}
+  CensusDisparity& compute(StereoPair &pair);
+};
@@ -0,0 +1,92 @@
+#include "data-cost-table.h"
+#include "thread-pool.h"
+
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+const uint16_t DataCostTable::UNKNOWN;
+
+void DataCostTable::build(const Mat &_left, const Mat &_right, int _min_d, int max_d,
+    size_t budget) {
+  left = _left;
+  right = _right;
+  min_d = _min_d;
+  num_d = max(0, max_d - min_d + 1);
+  row_size = (size_t) left.cols * num_d;
+
+  int rows = left.rows;
+  int cols = left.cols;
+  size_t row_bytes = max<size_t>(1, row_size * sizeof(uint16_t));
+  size_t num_slots = (budget == 0) ? rows : budget / row_bytes;
+  num_slots = max<size_t>(1, min<size_t>(num_slots, rows));
+  full = (int) num_slots == rows;
+
+  table.assign(num_slots * row_size, UNKNOWN);
+  slot_row.assign(num_slots, -1);
+
+  if (full) {
+    row_slot.clear();
+    prev_slot.clear();
+    next_slot.clear();
+
+    // Matches with right pixels outside the image keep UNKNOWN
+    ThreadPool::shared().parallel_for(rows, 8, [this, cols](int begin, int end, int) {
+      for (int y = begin; y < end; y++) {
+        uint16_t *row = &table[(size_t) y * row_size];
+        const Vec3b *l = left.ptr<Vec3b>(y);
+        const Vec3b *r = right.ptr<Vec3b>(y);
+        for (int x = 0; x < cols; x++) {
+          int k_min = max(0, x - min_d - cols + 1);
+          int k_max = min(num_d, x - min_d + 1);
+          for (int k = k_min; k < k_max; k++)
+            row[x * num_d + k] = distance(l[x], r[x - min_d - k]);
+        }
+      }
+    });
+    for (int y = 0; y < rows; y++)
+      slot_row[y] = y;
+    return;
+  }
+
+  row_slot.assign(rows, -1);
+  prev_slot.resize(num_slots);
+  next_slot.resize(num_slots);
+  for (size_t s = 0; s < num_slots; s++) {
+    prev_slot[s] = (int) s - 1;
+    next_slot[s] = (s + 1 < num_slots) ? (int) s + 1 : -1;
+  }
+  head = 0;
+  tail = (int) num_slots - 1;
+}
+
+uint16_t* DataCostTable::cached_row(int y) {
+  int s = row_slot[y];
+  if (s < 0) {
+    // Hand the least recently used slot over to row y
+    s = tail;
+    if (slot_row[s] >= 0)
+      row_slot[slot_row[s]] = -1;
+    slot_row[s] = y;
+    row_slot[y] = s;
+    fill(table.begin() + s * row_size, table.begin() + (s + 1) * row_size, UNKNOWN);
+  }
+  if (s != head)
+    touch(s);
+  return &table[s * row_size];
+}
+
+void DataCostTable::touch(int s) {
+  // Unlink s, which is not the head, so it has a previous slot
+  next_slot[prev_slot[s]] = next_slot[s];
+  if (next_slot[s] >= 0)
+    prev_slot[next_slot[s]] = prev_slot[s];
+  else
+    tail = prev_slot[s];
+
+  prev_slot[s] = -1;
+  next_slot[s] = head;
+  prev_slot[head] = s;
+  head = s;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "opencv2/core/core.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Matching costs of a CV_8UC3 stereo pair for every left pixel (x, y) and
+ * disparity d in [min_d, max_d]: the squared colour distance between left
+ * pixel x and right pixel x - d. The distance is truncated to an integer,
+ * as the graph cut always has, so it fits 16 bits and cost() squares it.
+ *
+ * Each image row keeps all of its (x, d) entries together. When the whole
+ * table fits in the budget every entry is worked out up front. Otherwise
+ * only the most recently used rows are kept, and an entry is worked out
+ * the first time it is asked for after its row came in. Lookups then write
+ * to the table, so they must not run in parallel.
+ */
+class DataCostTable {
+public:
+  /**
+   * Truncated distance between two colours. The float root of a sum of
+   * at most 3 * 255^2 never rounds up to the next integer, so this is the
+   * exact integer square root.
+   */
+  static int distance(const cv::Vec3b &a, const cv::Vec3b &b) {
+    int d0 = a[0] - b[0], d1 = a[1] - b[1], d2 = a[2] - b[2];
+    return (int) std::sqrt((float) (d0 * d0 + d1 * d1 + d2 * d2));
+  }
+
+  /**
+   * Set the table up for a pair. budget is in bytes, 0 for no limit, and
+   * never holds less than one row.
+   */
+  void build(const cv::Mat &left, const cv::Mat &right, int min_d, int max_d,
+    size_t budget = 0);
+
+  /** Cost of matching left pixel (x, y) to right pixel (x - d, y) */
+  int cost(int y, int x, int d) {
+    uint16_t *row = full ? &table[(size_t) y * row_size] : cached_row(y);
+    uint16_t &entry = row[x * num_d + d - min_d];
+    if (entry == UNKNOWN)
+      entry = distance(left.at<cv::Vec3b>(y, x), right.at<cv::Vec3b>(y, x - d));
+    return entry * entry;
+  }
+
+  /** Rows held at once */
+  int num_slots() const { return (int) slot_row.size(); }
+
+private:
+  static const uint16_t UNKNOWN = 0xffff;
+
+  cv::Mat left, right;
+  int min_d, num_d;
+  /** Entries per image row */
+  size_t row_size;
+  /** Whether every row has a slot of its own */
+  bool full;
+
+  /** num_slots() rows of row_size entries */
+  std::vector<uint16_t> table;
+
+  /**
+   * Budget mode: slot of each image row, -1 if it is not cached, and the
+   * row in each slot. Slots are kept in a list from the most recently used
+   * (head) to the least (tail), which is the one given to the next row.
+   */
+  std::vector<int> row_slot, slot_row;
+  std::vector<int> prev_slot, next_slot;
+  int head, tail;
+
+  /** Entries of row y, bringing the row in if it is not cached */
+  uint16_t* cached_row(int y);
+  /** Move slot s to the head of the list */
+  void touch(int s);
+};
@@ -1,6 +1,8 @@
 #include "stereo-dataset.h"
 #include "middlebury.h"
+#include "thread-pool.h"
 #include <opencv2/opencv.hpp>
+#include <algorithm>
 #include <fstream>
 #include <cstdlib>
 #include <iostream>
@@ -20,54 +22,79 @@ StereoPair::StereoPair(cv::Mat _left, cv::Mat _right,
 {
   rows = left.rows;
   cols = left.cols;
-  left.convertTo(left, CV_32FC3); 
-  right.convertTo(right, CV_32FC3);
   cvtColor(true_disparity_left, true_disparity_left, CV_BGR2GRAY);
   cvtColor(true_disparity_right, true_disparity_right, CV_BGR2GRAY);
 
-  // Mark disparities that map to out-of-bounds pixels as occlusions
-  for (int i = 0; i < rows; i++) {
-    for (int j = 0; j < cols; j++) {
-      int d_left = true_disparity_left.at<uchar>(i, j);
-      int j_right = j - d_left;
-      if (j_right < 0 || j_right >= cols) {
-        true_disparity_left.at<uchar>(i, j) = 0;
-      } else if ( abs((int)true_disparity_right.at<uchar>(i, j_right) - (int)d_left) > 2) {
-        true_disparity_left.at<uchar>(i, j) = 0;
+  // Mark disparities that map to out-of-bounds pixels, or that the other
+  // map does not send back to within 2, as occlusions. A right pixel is
+  // checked against the left map as loaded and a left pixel against the
+  // checked right map, as the single loop over both maps this replaced
+  // did, so each row takes the right map and then the left one.
+  // The bounds of the disparities left are gathered in the same pass.
+  ThreadPool &pool = ThreadPool::shared();
+  vector<int> min_left(pool.concurrency(), 255), max_left(pool.concurrency(), 0);
+  vector<int> min_right(pool.concurrency(), 255), max_right(pool.concurrency(), 0);
+  pool.parallel_for(rows, 16, [&](int begin, int end, int worker) {
+    int lo_left = min_left[worker], hi_left = max_left[worker];
+    int lo_right = min_right[worker], hi_right = max_right[worker];
+    for (int i = begin; i < end; i++) {
+      uchar *d_left = true_disparity_left.ptr<uchar>(i);
+      uchar *d_right = true_disparity_right.ptr<uchar>(i);
+
+      // left = right + disparity
+      for (int j = 0; j < cols; j++) {
+        int d = d_right[j];
+        int j_left = min(j + d, cols - 1);
+        bool keep = j + d < cols && abs(d_left[j_left] - d) <= 2;
+        d = keep ? d : 0;
+        d_right[j] = d;
+        lo_right = min(lo_right, d ? d : 255);
+        hi_right = max(hi_right, d);
       }
 
-      int d_right = true_disparity_right.at<uchar>(i, j);
-      int j_left = j + d_right;
-      if (j_left < 0 || j_left >= cols) {
-        true_disparity_right.at<uchar>(i, j) = 0;
-      } else if (
-          abs(
-            (int) true_disparity_left.at<uchar>(i, j_left)
-            - (int) d_right
-          ) > 2) {
-        true_disparity_right.at<uchar>(i, j) = 0;
+      // right = left - disparity
+      for (int j = 0; j < cols; j++) {
+        int d = d_left[j];
+        int j_right = max(j - d, 0);
+        bool keep = j - d >= 0 && abs(d_right[j_right] - d) <= 2;
+        d = keep ? d : 0;
+        d_left[j] = d;
+        lo_left = min(lo_left, d ? d : 255);
+        hi_left = max(hi_left, d);
       }
     }
-  }
+    min_left[worker] = lo_left;
+    max_left[worker] = hi_left;
+    min_right[worker] = lo_right;
+    max_right[worker] = hi_right;
+  });
 
   // Use the ground truth to find the minimum and maximum disparity
-  // to bound the search problem.
-  double mn, mx;
-  cv::Mat nonzero = (true_disparity_left != 0);
-  nonzero.convertTo(nonzero, CV_8U);
-  minMaxLoc(true_disparity_left, &mn, &mx, NULL, NULL, nonzero);
-  min_disparity_left = mn;
-  max_disparity_left = mx;
-
-  nonzero = (true_disparity_right != 0);
-  nonzero.convertTo(nonzero, CV_8U);
-  minMaxLoc(true_disparity_right, &mn, &mx, NULL, NULL, nonzero);
-  min_disparity_right = mn;
-  max_disparity_right = mx;
+  // to bound the search problem. A map with no disparities left gets 0
+  // for both, as cv::minMaxLoc gives.
+  min_disparity_left = *min_element(min_left.begin(), min_left.end());
+  max_disparity_left = *max_element(max_left.begin(), max_left.end());
+  if (max_disparity_left == 0)
+    min_disparity_left = 0;
+  min_disparity_right = *min_element(min_right.begin(), min_right.end());
+  max_disparity_right = *max_element(max_right.begin(), max_right.end());
+  if (max_disparity_right == 0)
+    min_disparity_right = 0;
 
   return;
 }
 
+StereoPair::StereoPair() :
+  base_offset(0),
+  rows(0),
+  cols(0),
+  min_disparity_left(0),
+  max_disparity_left(0),
+  min_disparity_right(0),
+  max_disparity_right(0)
+{
+}
+
 // Used for shrinking the image to speed up computation
 void StereoPair::resize(float scale) {
   cv::resize(left, left, Size(), scale, scale, CV_INTER_CUBIC);
@@ -84,6 +111,31 @@ void StereoPair::resize(float scale) {
   max_disparity_right *= scale;
 }
 
+void StereoPair::check_left_right(int tolerance) {
+  // Check both maps against the other one as it came out of matching
+  Mat original_left = disparity_left.clone();
+  Mat original_right = disparity_right.clone();
+
+  for (int i = 0; i < rows; i++) {
+    const uchar *d_left = original_left.ptr<uchar>(i);
+    const uchar *d_right = original_right.ptr<uchar>(i);
+    uchar *out_left = disparity_left.ptr<uchar>(i);
+    uchar *out_right = disparity_right.ptr<uchar>(i);
+
+    for (int j = 0; j < cols; j++) {
+      // right = left - disparity
+      int d = d_left[j];
+      if (d && (j - d < 0 || abs(d_right[j - d] - d) > tolerance))
+        out_left[j] = 0;
+
+      // left = right + disparity
+      d = d_right[j];
+      if (d && (j + d >= cols || abs(d_left[j + d] - d) > tolerance))
+        out_right[j] = 0;
+    }
+  }
+}
+
 StereoPair StereoDataset::get_stereo_pair(const string dataset, int illumination, int exposure) {
   char path[1024];
   // cout  << "Loading" << dataset << illumination << exposure << endl;
@@ -107,6 +159,23 @@ StereoPair StereoDataset::get_stereo_pair(const string dataset, int illumination
   return StereoPair(left, right, true_left, true_right, base_offset, ss.str());
 }
 
+void StereoDataset::set_cache_dir(const string dir) {
+  cache.reset(new PairCache(dir));
+}
+
+StereoPair StereoDataset::get_scaled_pair(const string dataset, float scale,
+    int illumination, int exposure) {
+  StereoPair pair;
+  if (cache && cache->read(dataset, illumination, exposure, scale, pair))
+    return pair;
+
+  pair = get_stereo_pair(dataset, illumination, exposure);
+  pair.resize(scale);
+  if (cache && !cache->write(dataset, illumination, exposure, scale, pair))
+    cerr << "Could not cache " << pair.name << endl;
+  return pair;
+}
+
 vector<string> StereoDataset::get_all_datasets() {
   vector<string> datasets;
   for (int i = 0; i < NumMiddleburyDatasets; i++) {
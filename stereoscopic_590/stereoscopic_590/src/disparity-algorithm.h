@@ -1,7 +1,24 @@
 #pragma once
 #include "stereo-pair.h"
+#include "progress-observer.h"
 
 class DisparityAlgorithm {
+protected:
+  /** Told about progress if set, otherwise the algorithm runs headless */
+  ProgressObserver *observer = nullptr;
+
+  void report_start(const StereoPair &pair) {
+    if (observer)
+      observer->on_start(pair);
+  }
+  void report_row(const StereoPair &pair, int row) {
+    if (observer)
+      observer->on_row(pair, row);
+  }
+
 public:
   virtual DisparityAlgorithm& compute(StereoPair &pair) = 0;
-};
\ No newline at end of file
+
+  /** The observer is not owned, and null stops the reports */
+  void set_observer(ProgressObserver *_observer) { observer = _observer; }
+};
@@ -1,10 +1,11 @@
 #include "graph-cut.h"
+#include "ncc.h"
+#include "thread-pool.h"
 #include "opencv2/core/core.hpp"
 
-#include <boost/graph/boykov_kolmogorov_max_flow.hpp>
-#include <boost/graph/read_dimacs.hpp>
-
-#include "opencv2/highgui/highgui.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 
 
 using namespace cv;
@@ -22,128 +23,195 @@ bool GraphCutDisparity::is_active(Correspondence c) {
  * Min-Cut Graph *
  *****************/
 
-long GraphCutDisparity::correspondence_hash(Correspondence c)
+void GraphCutDisparity::layout_bands(int iteration)
 {
-  long hash_key = c.x;
-
-  hash_key *= pair->rows;
-  hash_key += c.y;
-
-  hash_key *= (max_disparity - min_disparity + 1);
-  hash_key += (c.d - min_disparity);
-  
-  return hash_key;
+  int rows = pair->rows;
+  int num_bands = max(1, min(options.bands, rows));
+  int height = (rows + num_bands - 1) / num_bands;
+
+  // Core boundaries, moved up by half a band every other iteration
+  vector<int> bounds = {0};
+  int shift = (num_bands > 1 && iteration % 2 == 1) ? height / 2 : 0;
+  for (int y = height - shift; y < rows; y += height)
+    if (y > 0)
+      bounds.push_back(y);
+  bounds.push_back(rows);
+
+  bands.resize(bounds.size() - 1);
+  for (size_t i = 0; i < bands.size(); i++) {
+    Band &b = bands[i];
+    b.core_begin = bounds[i];
+    b.core_end = bounds[i + 1];
+    b.row_begin = max(0, b.core_begin - options.band_overlap);
+    b.row_end = min(rows, b.core_end + options.band_overlap);
+
+    // Per pixel at most an active and an alpha node, each with two
+    // neighbour edges (the other two belong to the neighbours) and an
+    // active node with two conflict edges
+    int num_pixels = (b.row_end - b.row_begin) * pair->cols;
+    if (!options.dynamic) {
+      b.g = &b.graph;
+      if (options.solver == SOLVER_BK)
+        b.g->reserve(2 * num_pixels, EDGES_PER_PIXEL * num_pixels);
+    }
+    b.active_index = cv::Mat(b.row_end - b.row_begin, pair->cols, CV_32S);
+    b.alpha_index = cv::Mat(b.row_end - b.row_begin, pair->cols, CV_32S);
+    b.active_pixels.reserve(num_pixels);
+    b.left_occlusion_count.assign(pair->cols, 0);
+    b.right_occlusion_count.assign(pair->cols, 0);
+  }
 }
 
-GraphCutDisparity::node_index GraphCutDisparity::get_index(Correspondence c)
+GraphCutDisparity::node_index GraphCutDisparity::get_index(Band &b, Correspondence c)
 {
-  long hash_key = correspondence_hash(c);
-  return hash_to_graph_index[hash_key];
+  // Any correspondence in the graph that is not alpha is active
+  if (options.dynamic)
+    return 2 * (c.y * pair->cols + c.x) + (c.d == alpha_disparity ? 0 : 1);
+  if (options.solver == SOLVER_GRID)
+    return b.grid.node(c.y - b.row_begin, c.x, c.d == alpha_disparity ? 0 : 1);
+  if (c.d == alpha_disparity)
+    return b.alpha_index.at<node_index>(c.y - b.row_begin, c.x);
+  return b.active_index.at<node_index>(c.y - b.row_begin, c.x);
 }
 
-GraphCutDisparity::Vertex GraphCutDisparity::get_vertex(Correspondence c)
+void GraphCutDisparity::add_nodes(Band &b, int num_alpha)
 {
-  node_index i = get_index(c);
-  return boost::vertex(i, g);
+  // Dynamic and grid graphs already have a node for every correspondence
+  if (options.dynamic || options.solver == SOLVER_GRID)
+    return;
+
+  for (int i = 0; i < b.num_active + num_alpha; i++)
+    b.g->add_node();
 }
 
-void GraphCutDisparity::add_node(Correspondence c)
+void GraphCutDisparity::set_index(Band &b, Correspondence c, node_index i)
 {
-  // Add to graph
-  Vertex node = boost::add_vertex(g);
+  if (options.dynamic || options.solver == SOLVER_GRID)
+    return;
 
-  // Record the index
-  long hash_key = correspondence_hash(c);
-  node_index idx = boost::get(vertex_indices, node);
-  hash_to_graph_index[hash_key] = idx;
+  if (c.d == alpha_disparity)
+    b.alpha_index.at<node_index>(c.y - b.row_begin, c.x) = i;
+  else
+    b.active_index.at<node_index>(c.y - b.row_begin, c.x) = i;
 }
 
-void GraphCutDisparity::add_edge(Correspondence c1, Correspondence c2,
+void GraphCutDisparity::add_edge(Band &b, Correspondence c1, Correspondence c2,
     edge_weight w_uv, edge_weight w_vu)
 {
-  Vertex u = get_vertex(c1);
-  Vertex v = get_vertex(c2);
-
-  Edge e, e_reverse;
-  // Add edges
-  tie(e, std::ignore) = boost::add_edge(u, v, g);
-  tie(e_reverse, std::ignore) = boost::add_edge(v, u, g);
-  // Give edges the appropriate weight
-  put(capacities, e, w_uv);
-  put(capacities, e_reverse, w_vu);
+  if (options.solver == SOLVER_GRID) {
+    b.grid.add_edge(get_index(b, c1), get_index(b, c2), w_uv, w_vu);
+    return;
+  }
+  if (!options.dynamic) {
+    b.g->add_edge(get_index(b, c1), get_index(b, c2), w_uv, w_vu);
+    return;
+  }
 
-  // Initialize properties for max flow calculation
-  put(residual_capacities, e, 0);
-  put(residual_capacities, e_reverse, 0);
-  put(reverse_edges, e, e_reverse);
-  put(reverse_edges, e_reverse, e);
+  // Find the slot. Smoothness edges belong to the left or upper pixel,
+  // which add_neighbor_edges passes second, and conflict edges to the
+  // active correspondence, which add_conflict_edges passes first.
+  int slot;
+  if (c1.d == c2.d) {
+    swap(c1, c2);
+    swap(w_uv, w_vu);
+    bool right = c2.x != c1.x;
+    if (c1.d == alpha_disparity)
+      slot = right ? ALPHA_RIGHT_EDGE : ALPHA_DOWN_EDGE;
+    else
+      slot = right ? ACTIVE_RIGHT_EDGE : ACTIVE_DOWN_EDGE;
+  } else if (c2.x == c1.x) {
+    slot = SAME_LEFT_EDGE;
+  } else {
+    slot = SAME_RIGHT_EDGE;
+    same_right_node[c1.y * pair->cols + c1.x] = get_index(b, c2);
+  }
+  int e = EDGES_PER_PIXEL * (c1.y * pair->cols + c1.x) + slot;
+  edge_caps[2 * e] = w_uv;
+  edge_caps[2 * e + 1] = w_vu;
 }
 
+void GraphCutDisparity::add_source_edge(Band &b, Correspondence c, edge_weight w)
+{
+  if (options.dynamic)
+    source_caps[get_index(b, c)] += w;
+  else if (options.solver == SOLVER_GRID)
+    b.grid.add_terminal_weights(get_index(b, c), w, 0);
+  else
+    b.g->add_terminal_weights(get_index(b, c), w, 0);
+}
 
-// See add_edge for details
-void GraphCutDisparity::add_source_edge(Correspondence c, edge_weight w)
+void GraphCutDisparity::add_sink_edge(Band &b, Correspondence c, edge_weight w)
 {
-  Vertex v = get_vertex(c);
-
-  Edge e, e_reverse;
-  tie(e, std::ignore) = boost::add_edge(source, v, g);
-  tie(e_reverse, std::ignore) = boost::add_edge(v, source, g);
-  put(capacities, e, w);
-  put(capacities, e_reverse, 0);
-  put(residual_capacities, e, 0);
-  put(residual_capacities, e_reverse, 0);
-  put(reverse_edges, e, e_reverse);
-  put(reverse_edges, e_reverse, e);
-  return;
+  if (options.dynamic)
+    sink_caps[get_index(b, c)] += w;
+  else if (options.solver == SOLVER_GRID)
+    b.grid.add_terminal_weights(get_index(b, c), 0, w);
+  else
+    b.g->add_terminal_weights(get_index(b, c), 0, w);
 }
 
-// See add_edge for details
-void GraphCutDisparity::add_sink_edge(Correspondence c, edge_weight w)
+bool GraphCutDisparity::in_source_segment(Band &b, Correspondence c)
 {
-  Vertex u = get_vertex(c);
-
-  Edge e, e_reverse;
-  tie(e, std::ignore) = boost::add_edge(u, sink, g);
-  tie(e_reverse, std::ignore) = boost::add_edge(sink, u, g);
-  put(capacities, e, w);
-  put(capacities, e_reverse, 0);
-  put(residual_capacities, e, 0);
-  put(residual_capacities, e_reverse, 0);
-  put(reverse_edges, e, e_reverse);
-  put(reverse_edges, e_reverse, e);
-  return;
+  if (options.solver == SOLVER_GRID)
+    return b.grid.in_source_segment(get_index(b, c));
+  return b.g->in_source_segment(get_index(b, c));
 }
 
-/**************
- * Cost Model *
- **************/
+/******************
+ * Dynamic graphs *
+ ******************/
 
-void GraphCutDisparity::for_each_active(function<void(Correspondence)> fn, int alpha) {
-  for (int y = 0; y < pair->rows; y++) {
-    for (int x = 0; x < pair->cols; x++) {
-      Correspondence c;
-      c.d = -pair->disparity_left.at<uchar>(y, x);
-      if (c.d != NULL_DISPARITY and c.d != alpha) {
-        c.x = x;
-        c.y = y;
-        fn(c);
-      }
-    }
+void GraphCutDisparity::build_dynamic_layout(Band &b)
+{
+  int cols = pair->cols;
+  int num_pixels = pair->rows * cols;
+  b.g->reserve(2 * num_pixels, EDGES_PER_PIXEL * num_pixels);
+  for (int i = 0; i < 2 * num_pixels; i++)
+    b.g->add_node();
+
+  // Smoothness edges past the right or bottom border never carry
+  // anything, so they are loops on the pixel's own node. A
+  // SAME_RIGHT_EDGE starts out on the alpha node of the same pixel.
+  for (int p = 0; p < num_pixels; p++) {
+    node_index right = (p % cols + 1 < cols) ? p + 1 : p;
+    node_index down = (p + cols < num_pixels) ? p + cols : p;
+    b.g->add_edge(2 * p, 2 * right, 0, 0);
+    b.g->add_edge(2 * p, 2 * down, 0, 0);
+    b.g->add_edge(2 * p + 1, 2 * right + 1, 0, 0);
+    b.g->add_edge(2 * p + 1, 2 * down + 1, 0, 0);
+    b.g->add_edge(2 * p + 1, 2 * p, 0, 0);
+    b.g->add_edge(2 * p + 1, 2 * p, 0, 0);
   }
 }
 
-void GraphCutDisparity::for_each_alpha(function<void(Correspondence)> fn, int alpha) {
-  for (int y = 0; y < pair->rows; y++) {
-    for (int x = 0; x < pair->cols; x++) {
-      Correspondence c;
-      c.x = x;
-      c.y = y;
-      c.d = alpha;
-      if (is_valid(c, alpha)) fn(c);
-    }
+void GraphCutDisparity::apply_dynamic_caps(Band &b)
+{
+  int num_nodes = b.g->num_nodes();
+  for (node_index i = 0; i < num_nodes; i++)
+    b.g->set_terminal_weights(i, source_caps[i], sink_caps[i]);
+
+  // An edge with nothing to join this time keeps its ends, which are as
+  // good as any with no capacity
+  int num_edges = b.g->num_edges();
+  for (int e = 0; e < num_edges; e++) {
+    edge_weight cap = edge_caps[2 * e];
+    edge_weight rev_cap = edge_caps[2 * e + 1];
+    int p = e / EDGES_PER_PIXEL;
+    if (e % EDGES_PER_PIXEL == SAME_RIGHT_EDGE && (cap != 0 || rev_cap != 0))
+      b.g->set_edge(e, 2 * p + 1, same_right_node[p], cap, rev_cap);
+    else
+      b.g->set_edge_capacity(e, cap, rev_cap);
   }
 }
 
+/**************
+ * Cost Model *
+ **************/
+
+int GraphCutDisparity::alpha_begin(int alpha) {
+  // Right pixel x + alpha must be in the image
+  return min(-alpha, pair->cols);
+}
 
 bool GraphCutDisparity::within_bounds(Correspondence c) {
 return (
@@ -167,286 +235,560 @@ bool GraphCutDisparity::is_valid(Correspondence c, int alpha) {
   );
 }
 
+bool GraphCutDisparity::is_candidate(Correspondence c) {
+  return within_bounds(c)
+    && (!use_candidates || candidates.contains(c.y, c.x, -c.d));
+}
+
+bool GraphCutDisparity::in_graph(Correspondence c, int alpha) {
+  // A pixel's current disparity is always one of its candidates
+  return c.d == alpha ? is_candidate(c) : within_bounds(c) && is_active(c);
+}
+
 inline int square(int x) {return x * x;}
 
 // squared error
 GraphCutDisparity::edge_weight GraphCutDisparity::data_cost(Correspondence c)
 {
+  if (options.cost_table)
+    return cost_table.cost(c.y, c.x, -c.d);
 
-  Vec3f col1 = pair->left.at<Vec3f>(c.y, c.x);
-  Vec3f col2 = pair->right.at<Vec3f>(c.y, c.x + c.d);
+  const Vec3b &col1 = pair->left.at<Vec3b>(c.y, c.x);
+  const Vec3b &col2 = pair->right.at<Vec3b>(c.y, c.x + c.d);
 
-  return square(cv::norm(col1 - col2));
+  return square(DataCostTable::distance(col1, col2));
 }
 
-GraphCutDisparity::edge_weight GraphCutDisparity::occ_cost(Correspondence c) {
+GraphCutDisparity::edge_weight GraphCutDisparity::occ_cost(Band &b, Correspondence c) {
   int occ_count = 0;
-  if (left_occlusion_count.at<uchar>(c.y, c.x) == 1)
+  if (b.left_occlusion_count[c.x] == 1)
     occ_count++;
-  if (right_occlusion_count.at<uchar>(c.y, c.x + c.d) == 1)
+  if (b.right_occlusion_count[c.x + c.d] == 1)
     occ_count++;
   return Cp * occ_count;
 } 
 
-void GraphCutDisparity::record_occlusion_count(Correspondence c, int alpha)
+void GraphCutDisparity::add_row(Band &b, int y, int alpha)
 {
-  left_occlusion_count.at<uchar>(c.y, c.x)++;
-  right_occlusion_count.at<uchar>(c.y, c.x + c.d)++;
-}
+  int cols = pair->cols;
+  int first_alpha = alpha_begin(alpha);
+  const uchar *disparity = pair->disparity_left.ptr<uchar>(y);
+  vector<int> &active_pixels = b.active_pixels;
+  size_t row_first = active_pixels.size();
+
+  // Occlusion counts and node indices. The active correspondences of the
+  // row continue the numbering of the rows above, and the alpha ones
+  // follow all active ones.
+  fill(b.left_occlusion_count.begin(), b.left_occlusion_count.end(), 0);
+  fill(b.right_occlusion_count.begin(), b.right_occlusion_count.end(), 0);
+  node_index next_active = (node_index) row_first;
+  for (int x = 0; x < cols; x++) {
+    int d = disparity[x];
+    if (d == NULL_DISPARITY || -d == alpha)
+      continue;
+    active_pixels.push_back(y * cols + x);
+    b.left_occlusion_count[x]++;
+    b.right_occlusion_count[x - d]++;
+    set_index(b, {x, y, -d}, next_active++);
+  }
+  vector<int> &alpha_pixels = b.alpha_pixels;
+  alpha_pixels.clear();
+  for (int x = first_alpha; x < cols; x++) {
+    if (use_candidates && !candidates.contains(y, x, -alpha))
+      continue;
+    alpha_pixels.push_back(x);
+    b.left_occlusion_count[x]++;
+    b.right_occlusion_count[x + alpha]++;
+    set_index(b, {x, y, alpha}, b.next_alpha++);
+  }
 
-void GraphCutDisparity::record_occlusion_counts(int alpha)
-{
-  for_each_active(
-    [this, alpha](Correspondence c) { record_occlusion_count(c, alpha); }
-    , alpha
-  );
-  for_each_alpha(
-    [this, alpha](Correspondence c) { record_occlusion_count(c, alpha); }
-    , alpha
-  );
-}
+  size_t row_end = active_pixels.size();
 
-void GraphCutDisparity::add_alpha_nodes(int alpha)
-{
-  for_each_alpha(
-    [this, alpha](Correspondence c) { add_alpha_node(c, alpha); }
-    , alpha
-  );
+  // Terminal edges
+  for (size_t i = row_first; i < row_end; i++) {
+    int x = active_pixels[i] - y * cols;
+    add_active_node(b, {x, y, -disparity[x]}, alpha);
+  }
+  for (int x : alpha_pixels)
+    add_alpha_node(b, {x, y, alpha}, alpha);
+
+  // Every node adds its edges in the order a sweep over the whole image
+  // per kind of edge would, so the max flow visits them in the same order
+  for (size_t i = row_first; i < row_end; i++) {
+    int x = active_pixels[i] - y * cols;
+    add_conflict_edges(b, {x, y, -disparity[x]}, alpha);
+  }
+  for (size_t i = row_first; i < row_end; i++) {
+    int x = active_pixels[i] - y * cols;
+    add_neighbor_edges(b, {x, y, -disparity[x]}, alpha);
+  }
+  for (int x : alpha_pixels)
+    add_neighbor_edges(b, {x, y, alpha}, alpha);
+
+  // Rows just outside the band keep their disparities
+  for (int outside : {b.row_begin - 1, b.row_end}) {
+    if (abs(outside - y) != 1 || outside < 0 || outside >= pair->rows)
+      continue;
+    for (size_t i = row_first; i < row_end; i++) {
+      int x = active_pixels[i] - y * cols;
+      int d = -disparity[x];
+      add_fixed_neighbor(b, {x, y, d}, {x, outside, d}, alpha);
+    }
+    for (int x : alpha_pixels)
+      add_fixed_neighbor(b, {x, y, alpha}, {x, outside, alpha}, alpha);
+  }
 }
 
-void GraphCutDisparity::add_alpha_node(Correspondence c, int alpha){
+void GraphCutDisparity::add_alpha_node(Band &b, Correspondence c, int alpha){
   edge_weight source_w = data_cost(c);
-  edge_weight sink_w = occ_cost(c);
+  edge_weight sink_w = occ_cost(b, c);
+
+  // Neighbours that may not take alpha stay inactive, so c pays for
+  // each of them if it becomes active
+  if (use_candidates) {
+    const Correspondence neighbors[] = {
+      {c.x, c.y - 1, c.d}, {c.x, c.y + 1, c.d},
+      {c.x + 1, c.y, c.d}, {c.x - 1, c.y, c.d}
+    };
+    for (const Correspondence &n : neighbors)
+      if (within_bounds(n) && !is_candidate(n))
+        source_w += V_smooth;
+  }
 
-  add_node(c);
-  add_source_edge(c, source_w);
-  add_sink_edge(c, sink_w);
+  add_source_edge(b, c, source_w);
+  add_sink_edge(b, c, sink_w);
 
   return;
 } 
 
-void GraphCutDisparity::add_active_nodes(int alpha)
-{
-  for_each_active(
-    [this, alpha](Correspondence c) { add_active_node(c, alpha); }
-    , alpha
-  );
-}
-
-void GraphCutDisparity::add_active_node(Correspondence c, int alpha){
-  edge_weight source_w = occ_cost(c);
+void GraphCutDisparity::add_active_node(Band &b, Correspondence c, int alpha){
+  edge_weight source_w = occ_cost(b, c);
   edge_weight sink_w = data_cost(c) + smooth_cost(c);
 
-  add_node(c);
-  add_source_edge(c, source_w);
-  add_sink_edge(c, sink_w);
+  add_source_edge(b, c, source_w);
+  add_sink_edge(b, c, sink_w);
   return;
 } 
 
 GraphCutDisparity::edge_weight GraphCutDisparity::smooth_cost(Correspondence c){
-  vector<Correspondence> neighbors = get_inactive_neighbors(c,c.d);
+  const Correspondence neighbors[] = {
+    {c.x, c.y - 1, c.d}, {c.x, c.y + 1, c.d},
+    {c.x + 1, c.y, c.d}, {c.x - 1, c.y, c.d}
+  };
+
+  int count = 0;
+  for (const Correspondence &n : neighbors) {
+    if (within_bounds(n) and !is_valid(n, c.d))
+      count++;
+  }
 
-  return V_smooth * neighbors.size();
+  return V_smooth * count;
 } 
 
-vector<GraphCutDisparity::Correspondence> GraphCutDisparity::get_inactive_neighbors(Correspondence c, int alpha){
-  vector<Correspondence> neighbors;
-  vector<int> offset = {0, 0, 1, -1};
-
-  // x +- 1, y +- 1 neighbors, where is_valid
-  for (size_t i=0; i<offset.size(); i++) {
-    Correspondence c_tmp = {c.x + offset[i], c.y + offset[offset.size()-1-i], c.d}; 
-
-    if(within_bounds(c_tmp) and !is_valid(c_tmp, alpha) ) {
-      neighbors.push_back(c_tmp);
-    }
-  }
+void GraphCutDisparity::add_conflict_edges(Band &b, Correspondence c, int alpha){
+  // check shared pixel
+  Correspondence c_alpha = {c.x, c.y, alpha};
+  if (is_candidate(c_alpha))
+    add_edge(b, c, c_alpha, INT_MAX, Cp);
 
-  return neighbors;
-}
+  // check shared mapped pixel
+  Correspondence c_mapped = {c.x + c.d - alpha, c.y, alpha};
+  if (is_candidate(c_mapped))
+    add_edge(b, c, c_mapped, INT_MAX, Cp);
 
-void GraphCutDisparity::add_all_conflict_edges(int alpha)
-{
-  for_each_active(
-    [this, alpha](Correspondence c) { add_conflict_edges(c, alpha); }
-    , alpha
-  );
+  return;
 }
 
-void GraphCutDisparity::add_conflict_edges(Correspondence c, int alpha){
-  vector<Correspondence> conflicts = get_conflicts(c,alpha);
+void GraphCutDisparity::add_neighbor_edges(Band &b, Correspondence c, int alpha){
+  // Neighbors share c.d, so taking the one above and the one to the
+  // left adds each pair once
+  Correspondence up = {c.x, c.y - 1, c.d};
+  if (c.y > b.row_begin && in_graph(up, alpha))
+    add_edge(b, c, up, V_smooth, V_smooth);
 
-  for (Correspondence c_tmp : conflicts) {
-    add_edge(c, c_tmp, INT_MAX, Cp);
-  }
+  Correspondence left = {c.x - 1, c.y, c.d};
+  if (in_graph(left, alpha))
+    add_edge(b, c, left, V_smooth, V_smooth);
 
   return;
-}
+} 
 
-vector<GraphCutDisparity::Correspondence> GraphCutDisparity::get_conflicts(Correspondence c, int alpha){
-  vector<Correspondence> conflicts;
+void GraphCutDisparity::add_fixed_neighbor(Band &b, Correspondence c, Correspondence n,
+    int alpha){
+  // Only pairs the whole-image graph would join by an edge
+  if (!in_graph(n, alpha))
+    return;
+
+  // V is paid when c and n end up in different states. An active c stays
+  // active on the source side and n is active, so c pays for the sink
+  // side. An alpha c is active on the sink side.
+  if (c.d == alpha && is_active(n))
+    add_sink_edge(b, c, V_smooth);
+  else
+    add_source_edge(b, c, V_smooth);
+}
 
-  if(is_active(c) and c.d != alpha ) {
-    // check shared pixel
-    Correspondence c_alpha = {c.x, c.y, alpha};
-    if (is_valid(c_alpha, alpha)) {
-      conflicts.push_back(c_alpha);
-    }
+/*************
+ * Algorithm *
+ *************/
 
-    // check shared mapped pixel
-    Correspondence c_mapped = { c.x + c.d - alpha, c.y, alpha};
-    if (is_valid(c_mapped, alpha)) {
-      conflicts.push_back(c_mapped);
+GraphCutDisparity::Energy GraphCutDisparity::get_energy()
+{
+  Energy energy;
+  int rows = pair->rows;
+  int cols = pair->cols;
+  long long occluded = 0;
+
+  for (int y = 0; y < rows; y++) {
+    const uchar *left = pair->disparity_left.ptr<uchar>(y);
+    const uchar *right = pair->disparity_right.ptr<uchar>(y);
+    for (int x = 0; x < cols; x++) {
+      occluded += (left[x] == NULL_DISPARITY) + (right[x] == NULL_DISPARITY);
+      if (left[x] == NULL_DISPARITY)
+        continue;
+
+      Correspondence c = {x, y, -left[x]};
+      energy.data += data_cost(c);
+
+      // Each pair with one active correspondence is counted from that one
+      const Correspondence neighbors[] = {
+        {x, y - 1, c.d}, {x, y + 1, c.d}, {x + 1, y, c.d}, {x - 1, y, c.d}
+      };
+      for (const Correspondence &n : neighbors) {
+        if (within_bounds(n) and !is_active(n))
+          energy.smoothness += V_smooth;
+      }
     }
   }
+  energy.occlusion = Cp * occluded;
 
-  return conflicts;
+  return energy;
 }
 
-void GraphCutDisparity::add_all_neighbor_edges(int alpha)
+void GraphCutDisparity::note_change(int x, int y, int old_d, int new_d)
 {
-  for_each_active(
-    [this, alpha](Correspondence c) { add_neighbor_edges(c, alpha); }
-    , alpha
-  );
-  for_each_alpha(
-    [this, alpha](Correspondence c) { add_neighbor_edges(c, alpha); }
-    , alpha
-  );
+  label_version[old_d]++;
+  label_version[new_d]++;
+  if (x > 0)
+    label_version[pair->disparity_left.at<uchar>(y, x - 1)]++;
+  if (x + 1 < pair->cols)
+    label_version[pair->disparity_left.at<uchar>(y, x + 1)]++;
+  if (y > 0)
+    label_version[pair->disparity_left.at<uchar>(y - 1, x)]++;
+  if (y + 1 < pair->rows)
+    label_version[pair->disparity_left.at<uchar>(y + 1, x)]++;
 }
 
-void GraphCutDisparity::add_neighbor_edges(Correspondence c, int alpha){
-  vector<Correspondence> neighbors = get_neighbors(c,alpha);
-
-  for (Correspondence c_tmp : neighbors) {
-    if (correspondence_hash(c) > correspondence_hash(c_tmp)) {
-      add_edge(c, c_tmp, V_smooth, V_smooth);
-    }
+bool GraphCutDisparity::run_iteration()
+{
+  vector<int> labels;
+  for (int alpha = min_disparity; alpha <= max_disparity; alpha++)
+    labels.push_back(alpha);
+
+  bool adaptive = options.schedule == SCHEDULE_ADAPTIVE;
+  if (adaptive) {
+    stable_sort(labels.begin(), labels.end(),
+      [this](int a, int b) { return label_gain[a] > label_gain[b]; });
   }
 
-  return;
-} 
+  bool improved = false;
+  for (int alpha : labels) {
+    if (adaptive && label_tried_version[alpha] == label_version[alpha])
+      continue;
+    // No pixel may take alpha, and so none has it
+    if (use_candidates && candidates.count(0, pair->rows, alpha) == 0)
+      continue;
+
+    int changed = run_alpha_expansion(-alpha);
+    improved = changed > 0 || improved;
+    label_gain[alpha] = changed;
+    label_tried_version[alpha] = label_version[alpha];
+    if (observer)
+      observer->on_alpha(*pair, alpha, changed > 0);
+  }
+  return improved;
+}
 
-vector<GraphCutDisparity::Correspondence> GraphCutDisparity::get_neighbors(Correspondence c, int alpha){
-  vector<Correspondence> neighbors;
-  vector<int> offset = {0, 0, 1, -1};
+int GraphCutDisparity::run_alpha_expansion(int alpha)
+{
+  // Only read the clock when tracing
+  typedef chrono::steady_clock clock;
+  auto now = [this]() { return trace ? clock::now() : clock::time_point(); };
+  auto seconds = [](clock::time_point a, clock::time_point b) {
+    return chrono::duration<double>(b - a).count();
+  };
+
+  clock::time_point start = now();
+  alpha_disparity = alpha;
+
+  // Bands only read the disparities, so they can be cut side by side.
+  // The time of several bands is all counted as max flow time.
+  clock::time_point built = start;
+  if (bands.size() == 1) {
+    build_band(bands[0], alpha);
+    built = now();
+    cut_band(bands[0]);
+  } else {
+    ThreadPool::shared().parallel_for((int) bands.size(), 1,
+        [this, alpha](int begin, int end, int) {
+      for (int i = begin; i < end; i++) {
+        build_band(bands[i], alpha);
+        cut_band(bands[i]);
+      }
+    });
+  }
+  clock::time_point cut = now();
 
-  // x +- 1, y +- 1 neighbors, where is_valid
-  for (size_t i=0; i<offset.size(); i++) {
-    Correspondence c_tmp = {c.x + offset[i], c.y + offset[offset.size()-1-i], c.d}; 
+  if (options.min_improvement > 0)
+    for (Band &b : bands)
+      unmodelled_drop += V_smooth * count_unmodelled_pairs(b);
 
-    if(is_valid(c_tmp, alpha) ) {
-      neighbors.push_back(c_tmp);
-    }
-  }
+  int changed = 0;
+  for (Band &b : bands)
+    changed += update_correspondences(b, alpha);
+  num_expansions++;
 
-  return neighbors;
-} 
+  if (trace)
+    write_trace(alpha, changed, seconds(start, built), seconds(built, cut),
+      seconds(cut, now()));
+  return changed;
+}
 
-/*************
- * Algorithm *
- *************/
+const char* GraphCutDisparity::trace_header()
+{
+  return "Name,Iteration,Alpha,"
+    "Nodes,Edges,"
+    "Build Time,Flow Time,Update Time,"
+    "Changed Pixels,"
+    "Data Energy,Occlusion Energy,Smoothness Energy,Energy";
+}
 
-bool GraphCutDisparity::run_iteration()
+void GraphCutDisparity::write_trace(int alpha, int changed,
+    double build_time, double flow_time, double update_time)
 {
-  bool improved = false;
-  for (int alpha = min_disparity; alpha <= max_disparity; alpha++) {
-    improved = run_alpha_expansion(-alpha) || improved;
-    // assert(run_alpha_expansion(-alpha) == false);
-    cv::imshow("WIP", 2 * pair->disparity_left);
-    cv::waitKey(50);
+  Energy energy = get_energy();
+  long long num_nodes = 0, num_edges = 0;
+  for (Band &b : bands) {
+    bool grid = options.solver == SOLVER_GRID;
+    num_nodes += grid ? b.grid.num_nodes() : b.g->num_nodes();
+    num_edges += grid ? b.grid.num_edges() : b.g->num_edges();
   }
-  return improved;
+  *trace << pair->name << "," << iteration << "," << -alpha << ","
+    << num_nodes << "," << num_edges << ","
+    << build_time << "," << flow_time << "," << update_time << ","
+    << changed << ","
+    << energy.data << "," << energy.occlusion << "," << energy.smoothness << ","
+    << energy.total()
+    << endl;
 }
 
-bool GraphCutDisparity::run_alpha_expansion(int alpha)
+void GraphCutDisparity::initialize_graph(Band &b, int alpha)
 {
-  initialize_graph();
-
-  record_occlusion_counts(alpha);
-  add_active_nodes(alpha);
-  add_alpha_nodes(alpha);
-
-  add_all_conflict_edges(alpha);
+  if (options.dynamic) {
+    b.g = &alpha_graphs[-alpha - min_disparity];
+    fill(source_caps.begin(), source_caps.end(), 0);
+    fill(sink_caps.begin(), sink_caps.end(), 0);
+    fill(edge_caps.begin(), edge_caps.end(), 0);
+  } else if (options.solver == SOLVER_GRID) {
+    b.grid.reset(b.row_end - b.row_begin, pair->cols, 2, options.grid_block_rows);
+  } else {
+    b.g->reset();
+  }
 
-  add_all_neighbor_edges(alpha);
+  return;
+}
 
-  // Compute min cut
-  boykov_kolmogorov_max_flow(g, source, sink);
+void GraphCutDisparity::build_band(Band &b, int alpha)
+{
+  initialize_graph(b, alpha);
+
+  if (b.row_begin == 0 && b.row_end == pair->rows) {
+    b.num_active = total_active - label_count[-alpha];
+  } else {
+    b.num_active = 0;
+    for (int y = b.row_begin; y < b.row_end; y++) {
+      const uchar *disparity = pair->disparity_left.ptr<uchar>(y);
+      for (int x = 0; x < pair->cols; x++)
+        b.num_active += disparity[x] != NULL_DISPARITY && -disparity[x] != alpha;
+    }
+  }
 
-  return update_correspondences(alpha);
+  int num_alpha = (b.row_end - b.row_begin) * (pair->cols - alpha_begin(alpha));
+  if (use_candidates)
+    num_alpha = candidates.count(b.row_begin, b.row_end, -alpha);
+  add_nodes(b, num_alpha);
+  b.next_alpha = b.num_active;
+  b.active_pixels.clear();
+  for (int y = b.row_begin; y < b.row_end; y++)
+    add_row(b, y, alpha);
 }
 
-void GraphCutDisparity::initialize_graph()
+void GraphCutDisparity::cut_band(Band &b)
 {
-  // Clear and reset properties
-  g.clear();
-  capacities = get(boost::edge_capacity_t(), g);
-  residual_capacities = get(boost::edge_residual_capacity_t(), g);
-  reverse_edges = get(boost::edge_reverse_t(), g);
-  vertex_indices = get(boost::vertex_index_t(), g);
-  colors = get(boost::vertex_color_t(), g);
-
-  hash_to_graph_index.clear();
-  left_occlusion_count.setTo(0);
-  right_occlusion_count.setTo(0);
-
-  // Add source / sink
-  source = boost::add_vertex(g);
-  sink = boost::add_vertex(g);
+  // Carry on from the last visit to alpha if the graph is kept
+  if (options.dynamic) {
+    bool visited = b.g->num_nodes() > 0;
+    if (!visited)
+      build_dynamic_layout(b);
+    apply_dynamic_caps(b);
+    b.g->max_flow(visited);
+  } else if (options.solver == SOLVER_GRID) {
+    b.grid.max_flow();
+  } else {
+    b.g->max_flow();
+  }
+}
 
-  return;
+long long GraphCutDisparity::count_unmodelled_pairs(Band &b)
+{
+  long long count = 0;
+  int cols = pair->cols;
+  for (int p : b.active_pixels) {
+    Correspondence c = {p % cols, p / cols, 0};
+    if (c.y < b.core_begin || c.y >= b.core_end)
+      continue;
+    c.d = -pair->disparity_left.at<uchar>(c.y, c.x);
+    if (in_source_segment(b, c))
+      continue;
+
+    // As get_energy counts them, before any of the band is updated
+    const Correspondence neighbors[] = {
+      {c.x, c.y - 1, c.d}, {c.x, c.y + 1, c.d}, {c.x + 1, c.y, c.d}, {c.x - 1, c.y, c.d}
+    };
+    for (const Correspondence &n : neighbors)
+      count += within_bounds(n) && !is_active(n);
+  }
+  return count;
 }
 
-bool GraphCutDisparity::update_correspondences(int alpha)
+int GraphCutDisparity::update_correspondences(Band &b, int alpha)
 {
-  Color black = boost::color_traits<Color>::black();
-
-  bool changed = false;
-  for_each_active(
-    [this, black, &changed](Correspondence c) {
-
-      Vertex node = get_vertex(c);
-      Color col = boost::get(colors, node);
-      if (col == black) // still active
-        return;
-      changed = true;
-      pair->disparity_left.at<uchar>(c.y, c.x) = NULL_DISPARITY;
-      pair->disparity_right.at<uchar>(c.y, c.x + c.d) = NULL_DISPARITY;
-      assert(!is_active(c));
-    }
-    , alpha
-  );
+  int changed = 0;
+  int cols = pair->cols;
+  for (int p : b.active_pixels) {
+    Correspondence c = {p % cols, p / cols, 0};
+    if (c.y < b.core_begin || c.y >= b.core_end)
+      continue;
+    c.d = -pair->disparity_left.at<uchar>(c.y, c.x);
+
+    if (in_source_segment(b, c)) // still active
+      continue;
+    changed++;
+    dropped_in[p] = num_expansions;
+    note_change(c.x, c.y, -c.d, NULL_DISPARITY);
+    pair->disparity_left.at<uchar>(c.y, c.x) = NULL_DISPARITY;
+    pair->disparity_right.at<uchar>(c.y, c.x + c.d) = NULL_DISPARITY;
+    label_count[-c.d]--;
+    total_active--;
+    assert(!is_active(c));
+  }
 
-  for_each_alpha(
-    [this, alpha, black, &changed](Correspondence c) {
+  int first_alpha = alpha_begin(alpha);
+  for (int y = b.core_begin; y < b.core_end; y++) {
+    uchar *left = pair->disparity_left.ptr<uchar>(y);
+    uchar *right = pair->disparity_right.ptr<uchar>(y);
 
-      bool was_active = is_active(c);
-      Vertex node = get_vertex(c);
-      Color col = boost::get(colors, node);
-      bool now_active = (col != black);
+    for (int x = first_alpha; x < cols; x++) {
+      Correspondence c = {x, y, alpha};
+      if (use_candidates && !candidates.contains(y, x, -alpha))
+        continue;
+      bool was_active = left[x] == -alpha;
+      bool now_active = !in_source_segment(b, c);
 
       if (now_active != was_active) {
-        changed = true;
+        // A pixel whose active correspondence was dropped above and
+        // that now takes alpha counts once
+        if (!now_active || dropped_in[y * cols + x] != num_expansions)
+          changed++;
+        note_change(x, y, left[x], now_active ? -alpha : NULL_DISPARITY);
         if (now_active) {
-          pair->disparity_left.at<uchar>(c.y, c.x) = -c.d;
-          pair->disparity_right.at<uchar>(c.y, c.x + c.d) = -c.d;
-          assert(is_active(c));
+          left[x] = -alpha;
+          right[x + alpha] = -alpha;
+          label_count[-alpha]++;
+          total_active++;
         } else {
-          pair->disparity_left.at<uchar>(c.y, c.x) = NULL_DISPARITY;
-          pair->disparity_right.at<uchar>(c.y, c.x + c.d) = NULL_DISPARITY;
-          assert(!is_active(c));
+          left[x] = NULL_DISPARITY;
+          right[x + alpha] = NULL_DISPARITY;
+          label_count[-alpha]--;
+          total_active--;
         }
       }
-
     }
-    , alpha
-  );
-    
+  }
+
   return changed;
 }
 
+void GraphCutDisparity::warm_start()
+{
+  NCCOptions ncc_options;
+  ncc_options.mode = NCC_RUNNING_SUM;
+  ncc_options.left_right_check = true;
+  NCCDisparity(options.warm_start_window, ncc_options).compute(*pair);
+
+  // The check lets the two maps disagree by one
+  seed(pair->disparity_left);
+}
+
+void GraphCutDisparity::seed(cv::Mat matched)
+{
+  // Rebuild the right map from the left one with every right pixel
+  // taken at most once
+  pair->disparity_left = cv::Mat(pair->rows, pair->cols, CV_8UC1);
+  pair->disparity_right = cv::Mat(pair->rows, pair->cols, CV_8UC1);
+  pair->disparity_left.setTo(NULL_DISPARITY);
+  pair->disparity_right.setTo(NULL_DISPARITY);
+
+  for (int y = 0; y < pair->rows; y++) {
+    const uchar *match = matched.ptr<uchar>(y);
+    uchar *left = pair->disparity_left.ptr<uchar>(y);
+    uchar *right = pair->disparity_right.ptr<uchar>(y);
+    for (int x = 0; x < pair->cols; x++) {
+      int d = match[x];
+      if (d < min_disparity || d > max_disparity || x - d < 0 || right[x - d] != NULL_DISPARITY)
+        continue;
+      left[x] = d;
+      right[x - d] = d;
+      label_count[d]++;
+      total_active++;
+    }
+  }
+}
+
 GraphCutDisparity& GraphCutDisparity::compute(StereoPair &_pair)
+{
+  if (options.levels > 0)
+    compute_pyramid(_pair);
+  else
+    solve(_pair, cv::Mat());
+  return *this;
+}
+
+void GraphCutDisparity::compute_pyramid(StereoPair &full)
+{
+  // The coarsest level tries every label, the usual way
+  GraphCutOptions coarse_options = options;
+  coarse_options.levels = 0;
+
+  StereoPair coarse = full;
+  coarse.resize(1.0f / (1 << options.levels));
+  GraphCutDisparity(Cp, V_smooth, coarse_options).compute(coarse);
+
+  // Every finer level is resized straight from the full pair
+  for (int level = options.levels - 1; level >= 0; level--) {
+    StereoPair fine = full;
+    if (level > 0)
+      fine.resize(1.0f / (1 << level));
+    solve(fine, coarse.disparity_left);
+    coarse = fine;
+  }
+
+  full.disparity_left = coarse.disparity_left;
+  full.disparity_right = coarse.disparity_right;
+  pair = &full;
+}
+
+void GraphCutDisparity::solve(StereoPair &_pair, const cv::Mat &coarse)
 {
   pair = &_pair;
 
@@ -463,21 +805,84 @@ GraphCutDisparity& GraphCutDisparity::compute(StereoPair &_pair)
   max_disparity = max_disparity + 2;
   max_disparity = (max_disparity > 255) ? 255 : max_disparity;
 
-  left_occlusion_count = cv::Mat(pair->rows, pair->cols, CV_8UC1);
-  right_occlusion_count = cv::Mat(pair->rows, pair->cols, CV_8UC1);
-
-  cv::imshow("Key", 2 * pair->true_disparity_left);
-  cv::waitKey(50);
-
-  for (int i = 0; i < num_iters; i++) {
-    run_iteration();
+  // Every pixel starts out occluded
+  label_count.assign(256, 0);
+  total_active = 0;
+  num_expansions = 0;
+  dropped_in.assign(pair->rows * pair->cols, -1);
+
+  label_gain.assign(256, 0);
+  label_version.assign(256, 0);
+  label_tried_version.assign(256, -1);
+
+  int num_pixels = pair->rows * pair->cols;
+  if (options.dynamic) {
+    alpha_graphs.clear();
+    alpha_graphs.resize(max_disparity - min_disparity + 1);
+    source_caps.assign(2 * num_pixels, 0);
+    sink_caps.assign(2 * num_pixels, 0);
+    edge_caps.assign(2 * EDGES_PER_PIXEL * num_pixels, 0);
+    same_right_node.assign(num_pixels, -1);
+  }
+  bands.clear();
+
+  if (!coarse.empty()) {
+    // Start from the coarser labeling, scaled up to this level
+    cv::Mat guess(pair->rows, pair->cols, CV_8UC1);
+    for (int y = 0; y < pair->rows; y++) {
+      const uchar *g = coarse.ptr<uchar>(min(y / 2, coarse.rows - 1));
+      uchar *out = guess.ptr<uchar>(y);
+      for (int x = 0; x < pair->cols; x++)
+        out[x] = min(2 * g[min(x / 2, coarse.cols - 1)], 255);
+    }
+    seed(guess);
+  } else if (options.warm_start_window > 0) {
+    warm_start();
   }
 
-  return *this;
+  if (options.cost_table)
+    cost_table.build(pair->left, pair->right, min_disparity, max_disparity,
+      options.cost_table_budget);
+  use_candidates = !coarse.empty() || options.candidate_labels > 0;
+  if (!coarse.empty())
+    candidates.build_around(coarse, options.level_band, min_disparity, max_disparity,
+      pair->disparity_left);
+  else if (options.candidate_labels > 0)
+    candidates.build(pair->left, pair->right, min_disparity, max_disparity,
+      options.candidate_labels, options.candidate_spread, options.candidate_window,
+      pair->disparity_left);
+
+  report_start(*pair);
+
+  long long energy = 0;
+  if (options.min_improvement > 0)
+    energy = get_energy().total();
+
+  for (int i = 0; i < options.max_iterations; i++) {
+    iteration = i;
+    layout_bands(i);
+    unmodelled_drop = 0;
+    bool improved = run_iteration();
+    if (observer)
+      observer->on_iteration(*pair, i, improved);
+    if (!improved)
+      break;
+
+    if (options.min_improvement > 0) {
+      // Judge the iteration by what its cuts minimized, leaving out the
+      // pairs get_energy counts but the graphs do not
+      long long last_energy = energy;
+      energy = get_energy().total();
+      long long gain = last_energy - energy - unmodelled_drop;
+      if (gain < options.min_improvement * last_energy)
+        break;
+    }
+  }
 }
 
-GraphCutDisparity::GraphCutDisparity(int _Cp, int _V) {
+GraphCutDisparity::GraphCutDisparity(int _Cp, int _V, GraphCutOptions _options) {
   Cp = _Cp;
   V_smooth = _V;
+  options = _options;
   return;
 }
\ No newline at end of file
@@ -1,13 +1,121 @@
 #pragma once
+#include "candidate-labels.h"
+#include "data-cost-table.h"
 #include "disparity-algorithm.h"
-
-#include <map>
-#include <boost/graph/adjacency_list.hpp>
-#include <boost/graph/graph_utility.hpp>
+#include "grid-max-flow.h"
+#include "max-flow.h"
 
 #include <climits>
 
-#include <functional>
+#include <ostream>
+#include <vector>
+
+/**
+ * Order in which GraphCutDisparity tries the labels in an iteration.
+ *
+ * SCHEDULE_SWEEP expands every label, from the smallest disparity up.
+ *
+ * SCHEDULE_ADAPTIVE tries first the labels whose last expansion changed
+ * the most pixels, and skips a label when no pixel with it, or next to
+ * one with it, has changed since it was last tried.
+ */
+enum LabelSchedule {
+  SCHEDULE_SWEEP,
+  SCHEDULE_ADAPTIVE
+};
+
+/**
+ * How GraphCutDisparity finds the min cut of an expansion.
+ *
+ * SOLVER_BK builds a MaxFlowGraph of just the nodes in the expansion.
+ *
+ * SOLVER_GRID builds a GridMaxFlow with two nodes per pixel, which cuts
+ * blocks of rows in parallel before the whole graph and finds the same
+ * cut.
+ */
+enum MaxFlowSolver {
+  SOLVER_BK,
+  SOLVER_GRID
+};
+
+struct GraphCutOptions {
+  /**
+   * Iterations over the labels at most. Iterations stop early once one
+   * changes nothing.
+   */
+  int max_iterations = 2;
+  /**
+   * Stop once an iteration lowers the energy its cuts minimize by less
+   * than this fraction of the energy, 0 to run on while anything changes
+   */
+  double min_improvement = 0;
+  LabelSchedule schedule = SCHEDULE_SWEEP;
+
+  /**
+   * Window size of a fast, left-right checked NCC match to start from,
+   * so the first iteration refines a labeling instead of building one up
+   * from every pixel occluded. 0 starts occluded.
+   */
+  int warm_start_window = 0;
+
+  /**
+   * Only let a pixel take its candidate_labels disparities of lowest data
+   * cost summed over a candidate_window square, and those within
+   * candidate_spread of them, in an expansion. Labels no pixel may take
+   * are not expanded. 0 lets every pixel take every label.
+   */
+  int candidate_labels = 0;
+  int candidate_spread = 1;
+  int candidate_window = 5;
+
+  /**
+   * Pyramid levels below full resolution. With levels > 0 the pair is
+   * solved at 1 / 2^levels resolution first. Each finer level starts
+   * from the labeling of the level below, scaled up, and a pixel only
+   * takes labels within level_band of twice the disparities around it
+   * there. The candidate_labels and warm start options then only apply
+   * to the coarsest level.
+   */
+  int levels = 0;
+  int level_band = 2;
+
+  /**
+   * Keep the graph of every alpha from one iteration to the next. On a
+   * later visit to the same alpha only the capacities that changed are
+   * updated, and the max flow carries on from the flow and search trees
+   * of the last visit. Holds one graph per label in memory.
+   */
+  bool dynamic = false;
+
+  /**
+   * Work the data cost of every correspondence out once per compute and
+   * look it up from then on, rather than on every expansion
+   */
+  bool cost_table = false;
+  /**
+   * Bytes the cost table may take, 0 for no limit. A table that does not
+   * fit keeps only the image rows used most recently.
+   */
+  size_t cost_table_budget = 0;
+
+  /**
+   * Split every expansion into this many horizontal bands and cut them
+   * on separate threads. Each band's graph reaches band_overlap rows into
+   * its neighbours, but only keeps the cut of its own rows, and the rows
+   * just outside it hold their current disparities. Band boundaries move
+   * by half a band every other iteration so no seam stays put.
+   *
+   * The result is close to, but no longer exactly, the minimum of each
+   * expansion. Needs dynamic off and no cost_table_budget.
+   */
+  int bands = 1;
+  int band_overlap = 8;
+
+  /** Needs dynamic off when not SOLVER_BK */
+  MaxFlowSolver solver = SOLVER_BK;
+  /** Rows per block of SOLVER_GRID */
+  int grid_block_rows = 16;
+};
 
 class GraphCutDisparity : public DisparityAlgorithm {
 private:
@@ -39,86 +147,140 @@ private:
    * Min-Cut Graph *
    *****************/
 
-  typedef int node_index;
-  typedef int edge_weight;
+  typedef MaxFlowGraph::node_id node_index;
+  typedef MaxFlowGraph::capacity edge_weight;
 
 
   int NULL_DISPARITY = 0;
 
 
-  /* Boost Graph Library code for use with min-cut algorithm */
-  typedef boost::vecS OutEdgeListT;
-  typedef boost::vecS VertexListT;
-  typedef boost::directedS DirectedT;
-
-  typedef boost::adjacency_list_traits <OutEdgeListT, VertexListT, DirectedT> Traits;
+  GraphCutOptions options;
 
-  typedef Traits::edge_descriptor Edge;
-  typedef Traits::vertex_descriptor Vertex;
-
-  typedef boost::default_color_type Color;
-
-  typedef
-      boost::property < boost::vertex_index_t, node_index,
-      boost::property < boost::vertex_color_t, Color,
-      boost::property < boost::vertex_distance_t, edge_weight,
-      boost::property < boost::vertex_predecessor_t, Edge> > > >
-    VertexPropertiesT;
+  /**
+   * The rows of the image one min-cut graph of an expansion covers, and
+   * what it takes to build that graph. Without the bands option there is
+   * a single band over the whole image.
+   */
+  struct Band {
+    /** Rows with nodes in the graph */
+    int row_begin, row_end;
+    /** Rows whose cut is kept */
+    int core_begin, core_end;
+
+    /**
+     * The min-cut graph of the current expansion. Without the dynamic
+     * option it is always graph, whose memory is reserved once per
+     * compute and reused by every expansion.
+     */
+    MaxFlowGraph *g;
+    MaxFlowGraph graph;
+    /**
+     * The graph with SOLVER_GRID instead, where the alpha correspondence
+     * of pixel (y, x) is node (y - row_begin, x, 0) and the active one
+     * node 1
+     */
+    GridMaxFlow grid;
+
+    /**
+     * Correspondences must be represented by nodes in the graph
+     * that have sequential indices. During an alpha expansion a pixel of
+     * the left image has at most one active correspondence and one with
+     * disparity alpha, so we keep their indices in two CV_32S images
+     * starting at row_begin, set only where the expansion has a node */
+    cv::Mat active_index, alpha_index;
+    /** Active correspondences other than alpha in the band */
+    int num_active;
+
+    /**
+     * Left pixels (y * cols + x) with an active correspondence other than
+     * alpha, in row-major order, collected while the graph is built
+     */
+    std::vector<int> active_pixels;
+    /**
+     * Columns of the row being built with a correspondence of disparity
+     * alpha, and the index of the next alpha node
+     */
+    std::vector<int> alpha_pixels;
+    node_index next_alpha;
+
+    /**
+     * Count the number of possible correspondences being considered
+     * that involve each pixel of the row being built. If two
+     * correspondences involve the pixel, the pixel cannot be occluded
+     * because one correspondence must remain active.
+     */
+    std::vector<uchar> left_occlusion_count, right_occlusion_count;
+  };
+  std::vector<Band> bands;
+
+  /** Lay the bands of an iteration out and make room for their graphs */
+  void layout_bands(int iteration);
+
+  /** Alpha of the expansion the graph is built for */
+  int alpha_disparity;
+  /** Get index of the node in the graph representing c */
+  node_index get_index(Band &b, Correspondence c);
+  /** After the cut, whether the node representing c is on the source side */
+  bool in_source_segment(Band &b, Correspondence c);
 
-  typedef
-      boost::property < boost::edge_capacity_t, edge_weight,
-      boost::property < boost::edge_residual_capacity_t, edge_weight,
-      boost::property < boost::edge_reverse_t, Edge> > >
-    EdgePropertiesT;
+  /**
+   * Give the active correspondences of the expansion the first indices,
+   * in row-major order, and the alpha ones the rest. Numbering them up
+   * front lets the graph be built a row at a time.
+   */
+  void add_nodes(Band &b, int num_alpha);
+  /** Record the index of the node representing c */
+  void set_index(Band &b, Correspondence c, node_index i);
 
-  typedef boost::adjacency_list <
-      OutEdgeListT, VertexListT, DirectedT,
-      VertexPropertiesT, EdgePropertiesT >
-    Graph;
+  /** Add neighbor constraints to correspondences c1 and c2 */
+  void add_edge(Band &b, Correspondence c1, Correspondence c2, edge_weight w_uv, edge_weight w_vu);
 
-  typedef boost::property_map<Graph, boost::edge_capacity_t>::type CapacityMap;
-  typedef boost::property_map<Graph, boost::edge_residual_capacity_t>::type ResidualMap;
-  typedef boost::property_map<Graph, boost::edge_reverse_t>::type ReverseMap;
-  typedef boost::property_map<Graph, boost::vertex_color_t>::type ColorMap;
-  typedef boost::property_map<Graph, boost::vertex_index_t>::type VertexIndexMap;
+  /** Add edges that represent the unary costs
+   * associated with a correspondence */
+  void add_source_edge(Band &b, Correspondence c, edge_weight w);
+  void add_sink_edge(Band &b, Correspondence c, edge_weight w);
 
-  VertexIndexMap vertex_indices;
-  CapacityMap capacities;
-  ResidualMap residual_capacities;
-  ReverseMap reverse_edges;
-  ColorMap colors;
+  /******************
+   * Dynamic graphs *
+   ******************/
 
   /**
-   * The min-cut graph itself
+   * With the dynamic option every alpha keeps a graph with the same
+   * layout, so nodes and edges of one visit can be found on the next.
+   * Pixel p owns nodes 2p (its alpha correspondence) and 2p + 1 (its
+   * active one) and the edges below, numbered EDGES_PER_PIXEL * p + slot.
+   * Slots with nothing to join this time have zero capacity.
    */
-  Graph g;
-
-  Vertex source;
-  Vertex sink;
+  enum EdgeSlot {
+    /** Smoothness edges to the pixel to the right and the one below */
+    ALPHA_RIGHT_EDGE, ALPHA_DOWN_EDGE,
+    ACTIVE_RIGHT_EDGE, ACTIVE_DOWN_EDGE,
+    /** Conflict between the active correspondence and the alpha one of
+     * the same left pixel */
+    SAME_LEFT_EDGE,
+    /** Conflict between the active correspondence and the alpha one of
+     * the same right pixel, which moves with the active disparity */
+    SAME_RIGHT_EDGE,
+    EDGES_PER_PIXEL
+  };
+
+  /** One graph per alpha, indexed by -alpha - min_disparity */
+  std::vector<MaxFlowGraph> alpha_graphs;
 
   /**
-   * Correspondences must be represented by nodes in the graph
-   * that have sequential indices. We keep track of these indices in
-   * a map */
-  std::map<long, node_index> hash_to_graph_index;
-  /** Use a hashing function to make index lookup easier */
-  long correspondence_hash(Correspondence c);
-  /** Get index of the node in the graph representing c */
-  node_index get_index(Correspondence c);
-  /** Get the node itself that represents correspondence c */
-  Vertex get_vertex(Correspondence c);
-
-
-  /** Add a node to the graph representing c */
-  void add_node(Correspondence c);
+   * Capacities of the graph being built, written by add_source_edge,
+   * add_sink_edge and add_edge in place of the graph. Edge e has
+   * edge_caps[2e] from the pixel that owns it and edge_caps[2e + 1] back.
+   */
+  std::vector<edge_weight> source_caps, sink_caps;
+  std::vector<edge_weight> edge_caps;
+  /** Alpha node the SAME_RIGHT_EDGE of each pixel leads to */
+  std::vector<node_index> same_right_node;
 
-  /** Add neighbor constraints to correspondences c1 and c2 */
-  void add_edge(Correspondence c1, Correspondence c2, edge_weight w_uv, edge_weight w_vu);
-
-  /** Add edges that represent the unary costs
-   * associated with a correspondence */
-  void add_source_edge(Correspondence c, edge_weight w);
-  void add_sink_edge(Correspondence c, edge_weight w);
+  /** Give the graph of b the layout with every capacity 0 */
+  void build_dynamic_layout(Band &b);
+  /** Move the capacities that were built into the graph of b */
+  void apply_dynamic_caps(Band &b);
 
   /**************
    * Cost Model *
@@ -132,10 +294,18 @@ private:
    * that are currently active or have disparity alpha.
    */
 
-  /** Active correspondences */
-  void for_each_active(std::function<void(Correspondence)> fn, int alpha);
-  /** Correspondences with disparity alpha */
-  void for_each_alpha(std::function<void(Correspondence)> fn, int alpha);
+  /**
+   * Number of active correspondences per disparity (the negated c.d),
+   * kept up to date by update_correspondences, and their total
+   */
+  std::vector<int> label_count;
+  int total_active;
+
+  /**
+   * First column with a correspondence of disparity alpha. Every pixel
+   * of a row from there on has one.
+   */
+  int alpha_begin(int alpha);
 
   /**
    * Neither the left image pixel nor
@@ -149,68 +319,123 @@ private:
    */
   bool is_valid(Correspondence c, int alpha);
 
+  /**
+   * Correspondence is within the bounds and, with the candidate_labels
+   * option, its disparity is a candidate of its left pixel
+   */
+  bool is_candidate(Correspondence c);
+  /** Candidates of the pair, with the candidate_labels option or below
+   * the coarsest pyramid level */
+  CandidateLabels candidates;
+  bool use_candidates;
+  /** Correspondence has a node in the expansion of alpha */
+  bool in_graph(Correspondence c, int alpha);
+
   /** Cost of the match between two pixels, using squared error */
   edge_weight data_cost(Correspondence c);
+  /** Data costs of the pair, with the cost_table option */
+  DataCostTable cost_table;
 
   /** Occlusion cost if this correspondence is deactivated */
-  edge_weight occ_cost(Correspondence c);
+  edge_weight occ_cost(Band &b, Correspondence c);
+
   /**
-   * Count the number of possible correspondences being considered
-   * that involve each pixel. If two correspondences involve the
-   * pixel, the pixel cannot be occluded because one correspondence
-   * must remain active.
+   * Add the nodes and edges of row y to the min-cut graph of b. Edges
+   * only lead up and left, so rows are built from the top.
    */
-  cv::Mat left_occlusion_count, right_occlusion_count;
-  void record_occlusion_count(Correspondence c, int alpha);
-  void record_occlusion_counts(int alpha);
+  void add_row(Band &b, int y, int alpha);
 
-  /**
-   * Add all correspondences with disparity alpha to the min-cut graph */
-  void add_alpha_nodes(int alpha);
   /** Add a node to the graph representing a correspondence with disparity
    * alpha and add source/sink edges to represent model costs */
-  void add_alpha_node(Correspondence c, int alpha);
-
-  /**
-   * Add all active correspondences to the min-cut graph */
-  void add_active_nodes(int alpha);
+  void add_alpha_node(Band &b, Correspondence c, int alpha);
   /**
    * Add a node to the graph representing an active correspondence
    * and add source/sink edges to represent model costs */
-  void add_active_node(Correspondence c, int alpha);
+  void add_active_node(Band &b, Correspondence c, int alpha);
   /** Smoothness cost w.r.t. inactive correspondences not considered
    * in the alpha expansion. */
   edge_weight smooth_cost(Correspondence c);
-  std::vector<Correspondence> get_inactive_neighbors(Correspondence c, int alpha);
 
   /**
    * Use neighbor costs to enforce the constraint that every pixel is involved
-   * in exactly one correspondence */
-  void add_all_conflict_edges(int alpha);
-  void add_conflict_edges(Correspondence c, int alpha);
-  /**
-   * Get all correspondences in the alpha expansion that could possibly conflict
-   * with Correspondence c */
-  std::vector<Correspondence> get_conflicts(Correspondence c, int alpha);
+   * in exactly one correspondence: join active c to the correspondences
+   * with disparity alpha that share its left or right pixel */
+  void add_conflict_edges(Band &b, Correspondence c, int alpha);
 
   /**
-   * Use neighbor costs to enforce a smoothness constraint */
-  void add_all_neighbor_edges(int alpha);
-  void add_neighbor_edges(Correspondence c, int alpha);
+   * Use neighbor costs to enforce a smoothness constraint: join c to the
+   * correspondences with the same disparity above and left of it */
+  void add_neighbor_edges(Band &b, Correspondence c, int alpha);
   /**
-   * Find all neighboring correspondences, i.e. correspondences in a
-   * 4-connected region that have the same disparity */
-  std::vector<Correspondence> get_neighbors(Correspondence c, int alpha);
+   * Smoothness between c and neighbour n in a row outside the band,
+   * which keeps its current state, as a unary cost on c */
+  void add_fixed_neighbor(Band &b, Correspondence c, Correspondence n, int alpha);
 
   /*************
    * Algorithm *
    *************/
 
-  int num_iters = 2; // Shows good results even if we stop early
+  /** Iteration being run */
+  int iteration;
+
+  /** Activate the correspondences of an NCC match of the pair */
+  void warm_start();
+  /**
+   * Activate the correspondences of the left disparity map matched,
+   * leaving out any whose left or right pixel another one already took
+   */
+  void seed(cv::Mat matched);
+
+  /**
+   * Run the graph cut on pair. A non-empty coarse is the left disparity
+   * map of the pyramid level below, to start from and keep near.
+   */
+  void solve(StereoPair &pair, const cv::Mat &coarse);
+  /** Solve full a pyramid level at a time, from the coarsest up */
+  void compute_pyramid(StereoPair &full);
+
+  /** Where to write a row per expansion, null for no trace */
+  std::ostream *trace = nullptr;
+  /**
+   * Write the trace row of the expansion of alpha, given how long it took
+   * to build the graph, find the cut and update the correspondences
+   */
+  void write_trace(int alpha, int changed,
+    double build_time, double flow_time, double update_time);
+
+  /**
+   * Energy of the current correspondences: the data cost of the active
+   * ones, Cp for every occluded pixel of either image and V for every
+   * pair of neighbouring correspondences with one of them active.
+   *
+   * The expansion graphs leave out the pairs whose active correspondence
+   * is not at alpha (smooth_cost is 0 for them), so a cut never raises
+   * this energy but can lower it by more than the cut was minimizing:
+   * V for each such pair whose active correspondence it drops.
+   */
+  struct Energy {
+    long long data = 0;
+    long long occlusion = 0;
+    long long smoothness = 0;
+    long long total() const { return data + occlusion + smoothness; }
+  };
+  Energy get_energy();
+
+  /**
+   * Per label (disparity), for the adaptive schedule: pixels changed by
+   * its last expansion, a count bumped whenever a pixel with the label or
+   * next to one changes, and that count when the label was last tried
+   * (-1 if never)
+   */
+  std::vector<int> label_gain;
+  std::vector<int> label_version, label_tried_version;
+  /** Bump the labels a change of pixel (x, y) from old_d to new_d touches */
+  void note_change(int x, int y, int old_d, int new_d);
 
   /**
    * Perform one iteration of the overall alpha expansion algorithm,
-   * meaning run an alpha expansion for all possible values of alpha
+   * meaning run an alpha expansion for every value of alpha the schedule
+   * picks
    */
   bool run_iteration();
 
@@ -218,25 +443,54 @@ private:
    * Perform an alpha expansion by setting up the graph, performing a min-cut,
    * and updating the correspondences
    *
-   * Returns true if an update was performed, false if nothing changed
+   * Returns the number of pixels whose disparity changed
    */
-  bool run_alpha_expansion(int alpha);
+  int run_alpha_expansion(int alpha);
 
   /**
    * Clear the graph - a new min-cut graph must be generated
-   * for every run. */
-  void initialize_graph();
+   * for every run. With the dynamic option, point g at the graph of
+   * alpha and clear the capacities to be built instead. */
+  void initialize_graph(Band &b, int alpha);
+  /** Build the graph of b for alpha */
+  void build_band(Band &b, int alpha);
+  /** Find the min cut of the graph of b */
+  void cut_band(Band &b);
+
+  /** Expansions run so far, and the one in which each left pixel last
+   * lost its active correspondence */
+  int num_expansions;
+  std::vector<int> dropped_in;
 
   /**
-   * Use the results of the min-cut to update which correspondences are active.
+   * Use the results of the min-cut to update which correspondences are
+   * active, in the core rows of b.
    *
-   * Returns true if an update was performed, false if nothing changed
+   * Returns the number of pixels whose disparity changed
+   */
+  int update_correspondences(Band &b, int alpha);
+
+  /**
+   * Before the update, the pairs of get_energy that the cut of b resolves
+   * without its graph modelling them: a dropped active correspondence
+   * and a neighbour at the same disparity that is not active
    */
-  bool update_correspondences(int alpha);
+  long long count_unmodelled_pairs(Band &b);
+  /** V times those pairs, over the expansions of this iteration */
+  long long unmodelled_drop;
 
 public:
   /**
    * Set up variables and run the graph cut algorithm */
   GraphCutDisparity& compute(StereoPair &pair);
-  GraphCutDisparity(int _Cp, int _V);
+  GraphCutDisparity(int _Cp, int _V, GraphCutOptions _options = GraphCutOptions());
+
+  /**
+   * Write a CSV row to trace after every expansion: the graph size, the
+   * time each step took in seconds, the pixels changed and the energy
+   * afterwards. The stream is not owned, and null stops the trace.
+   */
+  void set_trace(std::ostream *_trace) { trace = _trace; }
+  /** Header line of the trace */
+  static const char* trace_header();
 };
@@ -0,0 +1,250 @@
+#include "grid-max-flow.h"
+#include "thread-pool.h"
+
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+/** A terminal weight worked out in 64 bits, held to INT_MAX */
+static inline MaxFlowGraph::capacity clamp_weight(long long w) {
+  return (MaxFlowGraph::capacity) min(w, (long long) INT_MAX);
+}
+
+void GridMaxFlow::reset(int _rows, int _cols, int _nodes_per_pixel, int _block_rows) {
+  rows = _rows;
+  cols = _cols;
+  nodes_per_pixel = _nodes_per_pixel;
+  block_rows = max(1, _block_rows);
+  block_size = block_rows * cols * nodes_per_pixel;
+
+  source_weight.assign(num_nodes(), 0);
+  sink_weight.assign(num_nodes(), 0);
+
+  int num_blocks = (rows + block_rows - 1) / block_rows;
+  blocks.resize(num_blocks);
+  for (Block &block : blocks) {
+    block.edges.clear();
+    block.boundary.clear();
+  }
+  cross_edges.clear();
+}
+
+int GridMaxFlow::num_nodes() const {
+  return rows * cols * nodes_per_pixel;
+}
+
+int GridMaxFlow::num_edges() const {
+  size_t n = cross_edges.size();
+  for (const Block &block : blocks)
+    n += block.edges.size();
+  return (int) n;
+}
+
+int GridMaxFlow::num_unsettled() const {
+  return last.num_nodes();
+}
+
+void GridMaxFlow::add_terminal_weights(node_id i, capacity source, capacity sink) {
+  source_weight[i] += source;
+  sink_weight[i] += sink;
+}
+
+void GridMaxFlow::add_edge(node_id i, node_id j, capacity cap, capacity rev_cap) {
+  int b = i / block_size;
+  int c = j / block_size;
+  if (b == c) {
+    blocks[b].edges.push_back({i, j, cap, rev_cap});
+  } else {
+    // The edge charges i rev_cap if j is on the source side and i is
+    // not, and cap if j is on the sink side and i is not; j likewise
+    cross_edges.push_back({i, j, cap, rev_cap});
+    blocks[b].boundary.push_back({i, rev_cap, cap});
+    blocks[c].boundary.push_back({j, cap, rev_cap});
+  }
+}
+
+void GridMaxFlow::build_block(int b, bool outside_source) {
+  Block &block = blocks[b];
+  MaxFlowGraph &g = block.g;
+  node_id first = b * block_size;
+  int n = min(block_size, num_nodes() - first);
+
+  g.reset();
+  g.reserve(n, (int) block.edges.size());
+  for (int i = 0; i < n; i++)
+    g.add_node();
+  size_t k = 0;
+  for (int i = 0; i < n; i++) {
+    long long source = source_weight[first + i], sink = sink_weight[first + i];
+    if (k < block.boundary.size() && block.boundary[k].i == first + i) {
+      if (outside_source)
+        source += block.boundary[k].source;
+      else
+        sink += block.boundary[k].sink;
+      k++;
+    }
+    if (source != 0 || sink != 0)
+      g.add_terminal_weights(i, clamp_weight(source), clamp_weight(sink));
+  }
+  for (const Edge &e : block.edges)
+    g.add_edge(e.i - first, e.j - first, e.cap, e.rev_cap);
+}
+
+void GridMaxFlow::settle_block(int b) {
+  Block &block = blocks[b];
+  MaxFlowGraph &g = block.g;
+  node_id first = b * block_size;
+  int n = min(block_size, num_nodes() - first);
+
+  // One entry per boundary node, in order
+  vector<Boundary> &boundary = block.boundary;
+  sort(boundary.begin(), boundary.end());
+  size_t merged = 0;
+  for (size_t k = 0; k < boundary.size(); k++) {
+    if (merged > 0 && boundary[merged - 1].i == boundary[k].i) {
+      Boundary &m = boundary[merged - 1];
+      m.source = clamp_weight((long long) m.source + boundary[k].source);
+      m.sink = clamp_weight((long long) m.sink + boundary[k].sink);
+    } else {
+      boundary[merged++] = boundary[k];
+    }
+  }
+  boundary.resize(merged);
+
+  // The outside on the sink side first
+  build_block(b, false);
+  g.max_flow();
+  for (int i = 0; i < n; i++)
+    side[first + i] = g.in_source_segment(i) ? SOURCE : UNSETTLED;
+
+  // Then on the source side, carrying on from that flow. Changing the
+  // weights of a solved graph does not saturate, so weights near INT_MAX
+  // (infinite edges out of the block) build it afresh instead.
+  bool small = true;
+  for (const Boundary &m : boundary) {
+    small = small && (long long) source_weight[m.i] + m.source < INT_MAX / 2
+      && (long long) sink_weight[m.i] + m.sink < INT_MAX / 2;
+  }
+  if (small) {
+    for (const Boundary &m : boundary)
+      g.set_terminal_weights(m.i - first, source_weight[m.i] + m.source,
+        sink_weight[m.i]);
+    g.max_flow(true);
+  } else {
+    build_block(b, true);
+    g.max_flow();
+  }
+  for (int i = 0; i < n; i++)
+    if (!g.in_source_segment(i))
+      side[first + i] = SINK;
+}
+
+long long GridMaxFlow::reduce_edge(const Edge &e, vector<Edge> &out) {
+  Side a = side[e.i], b = side[e.j];
+  if (a == UNSETTLED && b == UNSETTLED) {
+    out.push_back({last_id[e.i], last_id[e.j], e.cap, e.rev_cap});
+  } else if (a == UNSETTLED) {
+    if (b == SOURCE)
+      extra_source[e.i] += e.rev_cap;
+    else
+      extra_sink[e.i] += e.cap;
+  } else if (b == UNSETTLED) {
+    if (a == SOURCE)
+      extra_source[e.j] += e.cap;
+    else
+      extra_sink[e.j] += e.rev_cap;
+  } else if (a != b) {
+    return a == SOURCE ? e.cap : e.rev_cap;
+  }
+  return 0;
+}
+
+void GridMaxFlow::reduce_block(int b) {
+  Block &block = blocks[b];
+  block.unsettled_edges.clear();
+  block.settled_cost = 0;
+
+  for (node_id i : block.unsettled) {
+    extra_source[i] = 0;
+    extra_sink[i] = 0;
+  }
+  node_id first = b * block_size;
+  int n = min(block_size, num_nodes() - first);
+  for (node_id i = first; i < first + n; i++) {
+    if (side[i] == SOURCE)
+      block.settled_cost += sink_weight[i];
+    else if (side[i] == SINK)
+      block.settled_cost += source_weight[i];
+  }
+  for (const Edge &e : block.edges)
+    block.settled_cost += reduce_edge(e, block.unsettled_edges);
+}
+
+long long GridMaxFlow::max_flow() {
+  int num_blocks = (int) blocks.size();
+  side.resize(num_nodes());
+  last_id.resize(num_nodes());
+  extra_source.resize(num_nodes());
+  extra_sink.resize(num_nodes());
+
+  ThreadPool::shared().parallel_for(num_blocks, 1,
+      [this](int begin, int end, int) {
+    for (int b = begin; b < end; b++) {
+      settle_block(b);
+      Block &block = blocks[b];
+      node_id first = b * block_size;
+      int n = min(block_size, num_nodes() - first);
+      block.unsettled.clear();
+      for (node_id i = first; i < first + n; i++)
+        if (side[i] == UNSETTLED)
+          block.unsettled.push_back(i);
+    }
+  });
+
+  // Number the unsettled nodes block by block
+  int num_last = 0;
+  for (Block &block : blocks)
+    for (node_id i : block.unsettled)
+      last_id[i] = num_last++;
+
+  ThreadPool::shared().parallel_for(num_blocks, 1,
+      [this](int begin, int end, int) {
+    for (int b = begin; b < end; b++)
+      reduce_block(b);
+  });
+
+  long long flow = 0;
+  cross_unsettled.clear();
+  for (const Edge &e : cross_edges)
+    flow += reduce_edge(e, cross_unsettled);
+
+  int num_last_edges = (int) cross_unsettled.size();
+  for (Block &block : blocks) {
+    flow += block.settled_cost;
+    num_last_edges += (int) block.unsettled_edges.size();
+  }
+
+  last.reset();
+  last.reserve(num_last, num_last_edges);
+  for (int k = 0; k < num_last; k++)
+    last.add_node();
+  for (Block &block : blocks) {
+    for (node_id i : block.unsettled)
+      last.add_terminal_weights(last_id[i],
+        clamp_weight(source_weight[i] + extra_source[i]),
+        clamp_weight(sink_weight[i] + extra_sink[i]));
+    for (const Edge &e : block.unsettled_edges)
+      last.add_edge(e.i, e.j, e.cap, e.rev_cap);
+  }
+  for (const Edge &e : cross_unsettled)
+    last.add_edge(e.i, e.j, e.cap, e.rev_cap);
+
+  return flow + last.max_flow();
+}
+
+bool GridMaxFlow::in_source_segment(node_id i) const {
+  if (side[i] != UNSETTLED)
+    return side[i] == SOURCE;
+  return last.in_source_segment(last_id[i]);
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include "max-flow.h"
+
+#include <vector>
+
+/**
+ * A min-cut graph laid out on an image grid, with nodes_per_pixel nodes
+ * per pixel numbered row by row, so node(y, x, k) is found without a
+ * lookup and the nodes of a row sit together in memory.
+ *
+ * The rows are split into blocks of block_rows, and max_flow settles
+ * most nodes block by block, side by side on the thread pool. Each block
+ * is solved twice with MaxFlowGraph: once as if every node outside it
+ * were on the sink side, then, re-solving from that flow, as if they
+ * were all on the source side. Moving the outside towards the source
+ * only grows the source side of the block, and the real outside lies
+ * somewhere between the two, so a node on the source side of the first
+ * solve is on it in the cut of the whole graph, and one on the sink side
+ * of the second is on the sink side.
+ *
+ * Only the nodes the two solves disagree on, mostly near the block
+ * edges, are left. They are solved together in one smaller graph, with
+ * the edges to settled nodes turned into terminal weights.
+ *
+ * in_source_segment tells whether a node is reachable from the source in
+ * the final residual graph. Every maximum flow leaves the same set
+ * reachable, so the cut is exactly the one MaxFlowGraph finds when
+ * solving the whole graph at once.
+ */
+class GridMaxFlow {
+public:
+  typedef MaxFlowGraph::node_id node_id;
+  typedef MaxFlowGraph::capacity capacity;
+
+  /** Set up an empty grid of rows x cols pixels, keeping the memory */
+  void reset(int rows, int cols, int nodes_per_pixel, int block_rows);
+
+  /** Node k of pixel (y, x) */
+  node_id node(int y, int x, int k) const {
+    return (y * cols + x) * nodes_per_pixel + k;
+  }
+  int num_nodes() const;
+  int num_edges() const;
+
+  /** Add to the capacities of the edges source -> i and i -> sink */
+  void add_terminal_weights(node_id i, capacity source, capacity sink);
+  /** Add the edges i -> j and j -> i, INT_MAX behaving as infinite */
+  void add_edge(node_id i, node_id j, capacity cap, capacity rev_cap);
+
+  /** Compute the maximum flow, which is also the cost of the min cut */
+  long long max_flow();
+  /** After max_flow, whether i is on the source side of the cut */
+  bool in_source_segment(node_id i) const;
+
+  /** After max_flow, how many nodes the blocks left for the last solve */
+  int num_unsettled() const;
+
+private:
+  struct Edge {
+    node_id i, j;
+    capacity cap, rev_cap;
+  };
+
+  /**
+   * Terminal weights an edge to another block gives node i: source when
+   * the other end is on the source side, sink when it is on the sink side
+   */
+  struct Boundary {
+    node_id i;
+    capacity source, sink;
+    bool operator<(const Boundary &other) const { return i < other.i; }
+  };
+
+  enum Side : char { UNSETTLED, SOURCE, SINK };
+
+  struct Block {
+    /** Edges within the block */
+    std::vector<Edge> edges;
+    std::vector<Boundary> boundary;
+    MaxFlowGraph g;
+
+    /** Nodes the block left unsettled, and the edges between them */
+    std::vector<node_id> unsettled;
+    std::vector<Edge> unsettled_edges;
+    /** Cost of the cut among the settled nodes */
+    long long settled_cost;
+  };
+
+  int rows, cols;
+  int nodes_per_pixel;
+  int block_rows;
+  /** Nodes in a full block */
+  int block_size;
+
+  std::vector<capacity> source_weight, sink_weight;
+
+  std::vector<Block> blocks;
+  /** Edges joining two blocks, and those of them between unsettled nodes */
+  std::vector<Edge> cross_edges, cross_unsettled;
+
+  /** Per node: its side, and for unsettled nodes their number in last */
+  std::vector<Side> side;
+  std::vector<node_id> last_id;
+  /** Terminal weights of unsettled nodes from edges to settled ones */
+  std::vector<long long> extra_source, extra_sink;
+  /** The unsettled nodes */
+  MaxFlowGraph last;
+
+  /** Build the graph of block b with every node outside it on one side */
+  void build_block(int b, bool outside_source);
+  /** Solve block b twice and settle what the two solves agree on */
+  void settle_block(int b);
+  /** Sort out the edges of block b for the last solve, given the sides */
+  void reduce_block(int b);
+  /**
+   * Sort out edge e for the last solve, adding it to out or to the extra
+   * weights. Returns what it costs the cut if both its ends are settled.
+   */
+  long long reduce_edge(const Edge &e, std::vector<Edge> &out);
+};
@@ -1,20 +1,67 @@
 #include "stereo-dataset.h"
+#include "pair-loader.h"
 #include "algorithms.h"
 #include "error-metrics.h"
+#include "thread-pool.h"
+#include "ncc-kernels.h"
+#include "census-kernels.h"
+#ifdef HAVE_PREVIEW
+#include "preview-observer.h"
+#endif
 #include <opencv2/opencv.hpp>
+#include <chrono>
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
 #include <fstream>
+#include <map>
 
 using namespace std;
 
+/**
+ * Optional trailing arguments of the form key=value tune the chosen
+ * algorithm, e.g. `stereo-depth 0.5 ncc 9 mode=fast`
+ */
+map<string, string> parse_options(int argc, const char *argv[], int first) {
+  map<string, string> options;
+  for (int i = first; i < argc; i++) {
+    string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if (eq == string::npos) {
+      cerr << "Options must look like key=value, got " << arg << endl;
+      exit(1);
+    }
+    options[arg.substr(0, eq)] = arg.substr(eq + 1);
+  }
+  return options;
+}
+
+/**
+ * Remove and return an option, or return default_value if it was not given */
+string take_option(map<string, string> &options, string key, string default_value) {
+  map<string, string>::iterator it = options.find(key);
+  if (it == options.end())
+    return default_value;
+  string value = it->second;
+  options.erase(it);
+  return value;
+}
+
+/**
+ * Every option should have been taken by the algorithm it tunes */
+void reject_unknown_options(const map<string, string> &options) {
+  if (!options.empty()) {
+    cerr << "Unknown option " << options.begin()->first << endl;
+    exit(1);
+  }
+}
+
 int main(int argc, const char *argv[]) {
   StereoDataset dataset;
   srand (time(NULL));
 
   if (argc < 3) {
-    cerr << "Must enter scale and either ncc or gc" << endl;
+    cerr << "Must enter scale and either ncc, census, sgm or gc" << endl;
     exit(1);
   }
 
@@ -23,13 +70,14 @@ int main(int argc, const char *argv[]) {
   string alg_name(argv[2]);
 
 
-  bool use_gc;
-  if (alg_name == "ncc") {
-    use_gc = false;
-  } else if (alg_name == "gc") {
-    use_gc = true;
+  // Number of positional parameters after the algorithm name
+  int num_params;
+  if (alg_name == "ncc" || alg_name == "census") {
+    num_params = 1;
+  } else if (alg_name == "gc" || alg_name == "sgm") {
+    num_params = 2;
   } else {
-    cerr << "Must enter either ncc or gc" << endl;
+    cerr << "Must enter either ncc, census, sgm or gc" << endl;
     exit(1);
   }
 
@@ -42,8 +90,34 @@ int main(int argc, const char *argv[]) {
   stringstream ss;
   string base_name;
   DisparityAlgorithm *alg;
+  GraphCutDisparity *gc = nullptr;
+  bool trace = false;
+
+  // Each option is taken out of args by the code it tunes
+  map<string, string> options = parse_options(argc, argv, 3 + num_params);
+  map<string, string> args = options;
+
+  int num_threads = atoi(take_option(args, "threads", "0").c_str());
+  ThreadPool::set_shared_concurrency(num_threads);
+
+  int prefetch = atoi(take_option(args, "prefetch", "2").c_str());
+  if (prefetch < 0) {
+    cerr << "prefetch must be at least 0" << endl;
+    exit(1);
+  }
+  string cache_dir = take_option(args, "cache", "");
+  if (!cache_dir.empty())
+    dataset.set_cache_dir(cache_dir);
+
+  bool preview = atoi(take_option(args, "preview", "0").c_str()) != 0;
+#ifndef HAVE_PREVIEW
+  if (preview) {
+    cerr << "preview=1 needs a build with OpenCV highgui" << endl;
+    exit(1);
+  }
+#endif
 
-  if (use_gc) {
+  if (alg_name == "gc") {
     if (argc < 5) {
       cerr << "Must enter Cp and V" << endl;
       exit(1);
@@ -52,10 +126,149 @@ int main(int argc, const char *argv[]) {
     V = atoi(argv[4]);
     param1 = Cp;
     param2 = V;
-    alg = new GraphCutDisparity(Cp, V);
+
+    GraphCutOptions gc_options;
+    gc_options.max_iterations = atoi(take_option(args, "iterations", "2").c_str());
+    if (gc_options.max_iterations < 1) {
+      cerr << "Graph cut needs at least one iteration" << endl;
+      exit(1);
+    }
+    gc_options.min_improvement = atof(take_option(args, "min_gain", "0").c_str());
+    if (gc_options.min_improvement < 0) {
+      cerr << "min_gain must be at least 0" << endl;
+      exit(1);
+    }
+    string schedule = take_option(args, "schedule", "sweep");
+    if (schedule == "adaptive") {
+      gc_options.schedule = SCHEDULE_ADAPTIVE;
+    } else if (schedule != "sweep") {
+      cerr << "Graph cut schedule must be either sweep or adaptive" << endl;
+      exit(1);
+    }
+    gc_options.warm_start_window = atoi(take_option(args, "warm_start", "0").c_str());
+    if (gc_options.warm_start_window < 0 || (gc_options.warm_start_window > 0
+        && (gc_options.warm_start_window < 3 || gc_options.warm_start_window % 2 == 0))) {
+      cerr << "warm_start must be 0 or an odd window size of at least 3" << endl;
+      exit(1);
+    }
+    gc_options.candidate_labels = atoi(take_option(args, "candidates", "0").c_str());
+    gc_options.candidate_spread = atoi(take_option(args, "candidate_spread", "1").c_str());
+    gc_options.candidate_window = atoi(take_option(args, "candidate_window", "5").c_str());
+    if (gc_options.candidate_labels < 0 || gc_options.candidate_spread < 0
+        || gc_options.candidate_window < 1 || gc_options.candidate_window % 2 == 0) {
+      cerr << "candidates and candidate_spread must be at least 0 and"
+        << " candidate_window odd" << endl;
+      exit(1);
+    }
+    gc_options.levels = atoi(take_option(args, "levels", "0").c_str());
+    if (gc_options.levels < 0 || gc_options.levels > 3) {
+      cerr << "Graph cut pyramid levels must be between 0 and 3" << endl;
+      exit(1);
+    }
+    gc_options.level_band = atoi(take_option(args, "band", "2").c_str());
+    if (gc_options.level_band < 1) {
+      cerr << "Graph cut band must be at least 1" << endl;
+      exit(1);
+    }
+    gc_options.dynamic = atoi(take_option(args, "dynamic", "0").c_str()) != 0;
+    gc_options.cost_table = atoi(take_option(args, "cost_table", "0").c_str()) != 0;
+    int cost_budget = atoi(take_option(args, "cost_budget", "0").c_str());
+    if (cost_budget < 0) {
+      cerr << "cost_budget must be at least 0" << endl;
+      exit(1);
+    }
+    gc_options.cost_table_budget = (size_t) cost_budget << 20;
+    gc_options.bands = atoi(take_option(args, "bands", "1").c_str());
+    gc_options.band_overlap = atoi(take_option(args, "overlap", "8").c_str());
+    if (gc_options.bands < 1 || gc_options.band_overlap < 0) {
+      cerr << "Graph cut needs at least one band and an overlap of at least 0" << endl;
+      exit(1);
+    }
+    string solver = take_option(args, "solver", "bk");
+    if (solver == "grid") {
+      gc_options.solver = SOLVER_GRID;
+    } else if (solver != "bk") {
+      cerr << "Graph cut solver must be either bk or grid" << endl;
+      exit(1);
+    }
+    gc_options.grid_block_rows = atoi(take_option(args, "block_rows", "16").c_str());
+    if (gc_options.grid_block_rows < 1) {
+      cerr << "block_rows must be at least 1" << endl;
+      exit(1);
+    }
+    if (gc_options.solver != SOLVER_BK && gc_options.dynamic) {
+      cerr << "solver=grid needs dynamic=0" << endl;
+      exit(1);
+    }
+    if (gc_options.bands > 1 && (gc_options.dynamic || cost_budget > 0)) {
+      cerr << "bands needs dynamic=0 and no cost_budget" << endl;
+      exit(1);
+    }
+    trace = atoi(take_option(args, "trace", "0").c_str()) != 0;
+    alg = gc = new GraphCutDisparity(Cp, V, gc_options);
     ss << "results/gc-scale-" << scale
       << "-Cp-" << Cp << "-V-" << V;
-    base_name = ss.str();
+  } else if (alg_name == "sgm") {
+    if (argc < 5) {
+      cerr << "Must enter P1 and P2" << endl;
+      exit(1);
+    }
+    int P1 = atoi(argv[3]);
+    int P2 = atoi(argv[4]);
+    if (P1 < 0 || P2 < P1 || P2 > 1000) {
+      cerr << "Penalties must satisfy 0 <= P1 <= P2 <= 1000" << endl;
+      exit(1);
+    }
+    param1 = P1;
+    param2 = P2;
+    ss << "results/sgm-scale-" << scale
+      << "-P1-" << P1 << "-P2-" << P2;
+
+    SGMOptions sgm_options;
+    sgm_options.paths = atoi(take_option(args, "paths", "8").c_str());
+    if (sgm_options.paths != 4 && sgm_options.paths != 8 && sgm_options.paths != 16) {
+      cerr << "SGM paths must be 4, 8 or 16" << endl;
+      exit(1);
+    }
+    sgm_options.census_size = atoi(take_option(args, "census", "5").c_str());
+    if (sgm_options.census_size < 3 || sgm_options.census_size > 7
+        || sgm_options.census_size % 2 == 0) {
+      cerr << "Census size must be 3, 5 or 7" << endl;
+      exit(1);
+    }
+    sgm_options.left_right_check = atoi(take_option(args, "lr_check", "0").c_str()) != 0;
+
+    string simd = take_option(args, "simd", "auto");
+    if (!select_census_kernels(simd)) {
+      cerr << "Census kernels " << simd << " are not supported on this machine" << endl;
+      exit(1);
+    }
+    alg = new SGMDisparity(P1, P2, sgm_options);
+  } else if (alg_name == "census") {
+    if (argc < 4) {
+      cerr << "Must enter window size" << endl;
+      exit(1);
+    }
+    window_size = atoi(argv[3]);
+    param1 = window_size;
+    ss << "results/census-scale-" << scale
+      << "-w-" << window_size;
+
+    CensusOptions census_options;
+    census_options.census_size = atoi(take_option(args, "census", "5").c_str());
+    if (census_options.census_size < 3 || census_options.census_size > 7
+        || census_options.census_size % 2 == 0) {
+      cerr << "Census size must be 3, 5 or 7" << endl;
+      exit(1);
+    }
+    census_options.left_right_check = atoi(take_option(args, "lr_check", "0").c_str()) != 0;
+
+    string simd = take_option(args, "simd", "auto");
+    if (!select_census_kernels(simd)) {
+      cerr << "Census kernels " << simd << " are not supported on this machine" << endl;
+      exit(1);
+    }
+    alg = new CensusDisparity(window_size, census_options);
   } else {
     if (argc < 4) {
       cerr << "Must enter window size" << endl;
@@ -63,10 +276,70 @@ int main(int argc, const char *argv[]) {
     }
     window_size = atoi(argv[3]);
     param1 = window_size;
-    alg = new NCCDisparity(window_size);
     ss << "results/ncc-scale-" << scale
       << "-w-" << window_size;
-    base_name = ss.str();
+
+    NCCOptions ncc_options;
+    string mode = take_option(args, "mode", "filter");
+    if (mode == "fast") {
+      ncc_options.mode = NCC_RUNNING_SUM;
+    } else if (mode != "filter") {
+      cerr << "NCC mode must be either filter or fast" << endl;
+      exit(1);
+    }
+
+    string volume = take_option(args, "volume", "separate");
+    if (volume == "shared") {
+      if (ncc_options.mode != NCC_RUNNING_SUM) {
+        cerr << "volume=shared needs mode=fast" << endl;
+        exit(1);
+      }
+      ncc_options.shared_volume = true;
+    } else if (volume != "separate") {
+      cerr << "NCC volume must be either separate or shared" << endl;
+      exit(1);
+    }
+    ncc_options.levels = atoi(take_option(args, "levels", "0").c_str());
+    if (ncc_options.levels < 0 || ncc_options.levels > 3) {
+      cerr << "NCC pyramid levels must be between 0 and 3" << endl;
+      exit(1);
+    }
+    ncc_options.band = atoi(take_option(args, "band", "2").c_str());
+    if (ncc_options.band < 1) {
+      cerr << "NCC band must be at least 1" << endl;
+      exit(1);
+    }
+    ncc_options.left_right_check = atoi(take_option(args, "lr_check", "0").c_str()) != 0;
+
+    string simd = take_option(args, "simd", "auto");
+    if (!select_ncc_kernels(simd)) {
+      cerr << "NCC kernels " << simd << " are not supported on this machine" << endl;
+      exit(1);
+    }
+    alg = new NCCDisparity(window_size, ncc_options);
+  }
+  reject_unknown_options(args);
+
+#ifdef HAVE_PREVIEW
+  PreviewObserver preview_observer;
+  if (preview)
+    alg->set_observer(&preview_observer);
+#endif
+
+  // Keep runs with different options apart. The thread count, the
+  // instruction set, the prefetching, the cache, the preview and the
+  // trace do not change the results.
+  for (auto &option : options)
+    if (option.first != "threads" && option.first != "simd" && option.first != "prefetch"
+        && option.first != "cache" && option.first != "preview" && option.first != "trace")
+      ss << "-" << option.first << "-" << option.second;
+  base_name = ss.str();
+
+  ofstream trace_stream;
+  if (trace) {
+    trace_stream.open(base_name + "-trace.csv");
+    trace_stream << GraphCutDisparity::trace_header() << endl;
+    gc->set_trace(&trace_stream);
   }
 
   string stats_file = base_name + "-stats.csv";
@@ -84,14 +357,16 @@ int main(int argc, const char *argv[]) {
     << "Right tn,Right fp,Right fn,Right tp"
     << endl;
 
-  for (string name : dataset.get_all_datasets()) {
-    StereoPair pair = dataset.get_stereo_pair(name);
-    pair.resize(scale);
+  // The next pairs load in the background while the current one is
+  // computed, so only wall time leaves their decoding out
+  PairLoader loader(dataset, dataset.get_all_datasets(), scale, prefetch);
+  while (loader.has_next()) {
+    StereoPair pair = loader.next();
 
-    clock_t start_time = clock();
+    chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
     alg->compute(pair);
-    clock_t end_time = clock();
-    double elapsed_time = (double) (end_time - start_time) / (double) CLOCKS_PER_SEC;
+    chrono::steady_clock::time_point end_time = chrono::steady_clock::now();
+    double elapsed_time = chrono::duration<double>(end_time - start_time).count();
 
     double rmse_left = ErrorMetrics::get_rms_error_unoccluded(pair.true_disparity_left, pair.disparity_left);
     double rmse_right = ErrorMetrics::get_rms_error_unoccluded(pair.true_disparity_right, pair.disparity_right);
@@ -0,0 +1,558 @@
+#include "max-flow.h"
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+const MaxFlowGraph::arc_id MaxFlowGraph::NO_PARENT;
+const MaxFlowGraph::arc_id MaxFlowGraph::TERMINAL;
+const MaxFlowGraph::arc_id MaxFlowGraph::ORPHAN;
+
+/** Longer than any path in a tree */
+static const int INFINITE_DIST = INT_MAX;
+
+/** a + b for residuals, holding INT_MAX as infinite */
+static inline MaxFlowGraph::capacity add_residual(MaxFlowGraph::capacity a,
+    MaxFlowGraph::capacity b) {
+  return (a > INT_MAX - b) ? INT_MAX : a + b;
+}
+
+/** A residual worked out in 64 bits, held to [0, INT_MAX] */
+static inline MaxFlowGraph::capacity clamp_residual(long long r) {
+  return (MaxFlowGraph::capacity) max(0LL, min(r, (long long) INT_MAX));
+}
+
+/******************
+ * Graph building *
+ ******************/
+
+void MaxFlowGraph::reserve(int num_nodes, int num_edges) {
+  first.reserve(num_nodes);
+  parent.reserve(num_nodes);
+  next_active.reserve(num_nodes);
+  timestamp.reserve(num_nodes);
+  dist.reserve(num_nodes);
+  is_sink.reserve(num_nodes);
+  terminal_cap.reserve(num_nodes);
+  source_weight.reserve(num_nodes);
+  sink_weight.reserve(num_nodes);
+  is_marked.reserve(num_nodes);
+
+  head.reserve(2 * num_edges);
+  next.reserve(2 * num_edges);
+  residual.reserve(2 * num_edges);
+  arc_cap.reserve(2 * num_edges);
+  shift.reserve(num_edges);
+  edge_flow.reserve(num_edges);
+}
+
+void MaxFlowGraph::reset() {
+  first.clear();
+  parent.clear();
+  next_active.clear();
+  timestamp.clear();
+  dist.clear();
+  is_sink.clear();
+  terminal_cap.clear();
+  source_weight.clear();
+  sink_weight.clear();
+  is_marked.clear();
+
+  head.clear();
+  next.clear();
+  residual.clear();
+  arc_cap.clear();
+  shift.clear();
+  edge_flow.clear();
+
+  flow = 0;
+  solved = false;
+  changed.clear();
+}
+
+MaxFlowGraph::node_id MaxFlowGraph::add_node() {
+  first.push_back(-1);
+  parent.push_back(NO_PARENT);
+  next_active.push_back(-1);
+  timestamp.push_back(0);
+  dist.push_back(0);
+  is_sink.push_back(0);
+  terminal_cap.push_back(0);
+  source_weight.push_back(0);
+  sink_weight.push_back(0);
+  is_marked.push_back(0);
+  return (node_id) first.size() - 1;
+}
+
+int MaxFlowGraph::num_nodes() const {
+  return (int) first.size();
+}
+
+int MaxFlowGraph::num_edges() const {
+  return (int) shift.size();
+}
+
+void MaxFlowGraph::add_terminal_weights(node_id i, capacity source, capacity sink) {
+  source_weight[i] += source;
+  sink_weight[i] += sink;
+  shift_terminal(i, source, sink);
+}
+
+void MaxFlowGraph::shift_terminal(node_id i, capacity source, capacity sink) {
+  // Flow through source -> i -> sink saturates the smaller edge straight
+  // away, so only the difference is kept. A negative weight below the
+  // flow already pushed adds the shortfall to both edges, which shifts
+  // every cut by the same amount.
+  capacity delta = terminal_cap[i];
+  if (delta > 0)
+    source += delta;
+  else
+    sink -= delta;
+  flow += min(source, sink);
+  terminal_cap[i] = source - sink;
+}
+
+MaxFlowGraph::edge_id MaxFlowGraph::add_edge(node_id i, node_id j,
+    capacity cap, capacity rev_cap) {
+  arc_id a = (arc_id) head.size();
+
+  head.push_back(j);
+  next.push_back(first[i]);
+  residual.push_back(cap);
+  arc_cap.push_back(cap);
+  first[i] = a;
+
+  head.push_back(i);
+  next.push_back(first[j]);
+  residual.push_back(rev_cap);
+  arc_cap.push_back(rev_cap);
+  first[j] = a + 1;
+
+  shift.push_back(0);
+  edge_flow.push_back(0);
+
+  return a / 2;
+}
+
+/*******************
+ * Dynamic updates *
+ *******************/
+
+void MaxFlowGraph::mark(node_id i) {
+  if (is_marked[i])
+    return;
+  is_marked[i] = 1;
+  changed.push_back(i);
+}
+
+void MaxFlowGraph::unlink_arc(arc_id a) {
+  node_id i = head[sister(a)];
+  if (first[i] == a) {
+    first[i] = next[a];
+    return;
+  }
+  arc_id b = first[i];
+  while (next[b] != a)
+    b = next[b];
+  next[b] = next[a];
+}
+
+void MaxFlowGraph::set_terminal_weights(node_id i, capacity source, capacity sink) {
+  if (source == source_weight[i] && sink == sink_weight[i])
+    return;
+  add_terminal_weights(i, source - source_weight[i], sink - sink_weight[i]);
+  mark(i);
+}
+
+void MaxFlowGraph::set_edge(edge_id e, node_id i, node_id j,
+    capacity cap, capacity rev_cap) {
+  arc_id a = 2 * e;
+  arc_id b = a + 1;
+
+  if (head[b] != i || head[a] != j) {
+    // Empty the edge where it is. With no residual either way it carries
+    // exactly its shift, which the terminals of its ends already make up
+    // for, so both arcs can move over with a shift of 0. A node whose
+    // parent was across the edge is left for init_from_trees to orphan.
+    set_edge(e, head[b], head[a], 0, 0);
+    if (parent[head[b]] == a)
+      parent[head[b]] = ORPHAN;
+    if (parent[head[a]] == b)
+      parent[head[a]] = ORPHAN;
+    unlink_arc(a);
+    unlink_arc(b);
+    head[a] = j;
+    next[a] = first[i];
+    first[i] = a;
+    head[b] = i;
+    next[b] = first[j];
+    first[j] = b;
+    residual[a] = 0;
+    residual[b] = 0;
+    arc_cap[a] = 0;
+    arc_cap[b] = 0;
+    shift[e] = 0;
+    edge_flow[e] = 0;
+  } else if (arc_cap[a] == cap && arc_cap[b] == rev_cap) {
+    return;
+  }
+  mark(i);
+  mark(j);
+
+  // Keep the flow if it fits. If it is over a new capacity, shift that
+  // capacity up to the flow and the reverse one down by as much, and
+  // add the excess to source -> tail and head -> sink. Every cut goes up
+  // by the excess, so the min cut stays where it is.
+  long long f = arc_flow(a);
+  long long forward = (long long) cap + shift[e];
+  long long backward = (long long) rev_cap - shift[e];
+  if (f > forward) {
+    capacity excess = (capacity) (f - forward);
+    shift[e] += excess;
+    shift_terminal(i, excess, 0);
+    shift_terminal(j, 0, excess);
+    flow -= excess;
+  } else if (-f > backward) {
+    capacity excess = (capacity) (-f - backward);
+    shift[e] -= excess;
+    shift_terminal(j, excess, 0);
+    shift_terminal(i, 0, excess);
+    flow -= excess;
+  }
+  arc_cap[a] = cap;
+  arc_cap[b] = rev_cap;
+  residual[a] = clamp_residual((long long) cap + shift[e] - f);
+  residual[b] = clamp_residual((long long) rev_cap - shift[e] + f);
+}
+
+void MaxFlowGraph::set_edge_capacity(edge_id e, capacity cap, capacity rev_cap) {
+  set_edge(e, head[2 * e + 1], head[2 * e], cap, rev_cap);
+}
+
+/************
+ * Max flow *
+ ************/
+
+void MaxFlowGraph::set_active(node_id i) {
+  if (next_active[i] >= 0)
+    return;
+  if (active_last >= 0)
+    next_active[active_last] = i;
+  else
+    active_first = i;
+  active_last = i;
+  next_active[i] = i;
+}
+
+MaxFlowGraph::node_id MaxFlowGraph::pop_active() {
+  while (active_first >= 0) {
+    node_id i = active_first;
+    if (next_active[i] == i) {
+      active_first = -1;
+      active_last = -1;
+    } else {
+      active_first = next_active[i];
+    }
+    next_active[i] = -1;
+
+    // Nodes freed while queued are skipped
+    if (parent[i] != NO_PARENT)
+      return i;
+  }
+  return -1;
+}
+
+void MaxFlowGraph::set_orphan(node_id i) {
+  parent[i] = ORPHAN;
+  orphans.push_back(i);
+}
+
+void MaxFlowGraph::augment(arc_id middle) {
+  // Bottleneck of the path, through the source tree then the sink tree
+  capacity bottleneck = residual[middle];
+  node_id i;
+  arc_id a;
+  for (i = head[sister(middle)]; (a = parent[i]) != TERMINAL; i = head[a])
+    bottleneck = min(bottleneck, residual[sister(a)]);
+  bottleneck = min(bottleneck, terminal_cap[i]);
+  for (i = head[middle]; (a = parent[i]) != TERMINAL; i = head[a])
+    bottleneck = min(bottleneck, residual[a]);
+  bottleneck = min(bottleneck, -terminal_cap[i]);
+
+  // Push it, orphaning nodes whose parent arc saturates
+  residual[sister(middle)] = add_residual(residual[sister(middle)], bottleneck);
+  residual[middle] -= bottleneck;
+  add_arc_flow(middle, bottleneck);
+
+  for (i = head[sister(middle)]; (a = parent[i]) != TERMINAL; i = head[a]) {
+    residual[a] = add_residual(residual[a], bottleneck);
+    residual[sister(a)] -= bottleneck;
+    add_arc_flow(sister(a), bottleneck);
+    if (residual[sister(a)] == 0)
+      set_orphan(i);
+  }
+  terminal_cap[i] -= bottleneck;
+  if (terminal_cap[i] == 0)
+    set_orphan(i);
+
+  for (i = head[middle]; (a = parent[i]) != TERMINAL; i = head[a]) {
+    residual[sister(a)] = add_residual(residual[sister(a)], bottleneck);
+    residual[a] -= bottleneck;
+    add_arc_flow(a, bottleneck);
+    if (residual[a] == 0)
+      set_orphan(i);
+  }
+  terminal_cap[i] += bottleneck;
+  if (terminal_cap[i] == 0)
+    set_orphan(i);
+
+  flow += bottleneck;
+}
+
+void MaxFlowGraph::adopt(node_id i) {
+  bool sink = is_sink[i];
+  arc_id best = NO_PARENT;
+  int best_dist = INFINITE_DIST;
+
+  // Look for a neighbour in the same tree that still leads to its
+  // terminal and can pass flow to (or from) i
+  for (arc_id a = first[i]; a >= 0; a = next[a]) {
+    if (residual[sink ? a : sister(a)] == 0)
+      continue;
+    node_id j = head[a];
+    if (is_sink[j] != sink || parent[j] == NO_PARENT)
+      continue;
+
+    // Walk up to the terminal or to a node checked this time
+    int d = 0;
+    node_id k = j;
+    while (true) {
+      if (timestamp[k] == time) {
+        d += dist[k];
+        break;
+      }
+      arc_id up = parent[k];
+      d++;
+      if (up == TERMINAL) {
+        timestamp[k] = time;
+        dist[k] = 1;
+        break;
+      }
+      if (up == ORPHAN) {
+        d = INFINITE_DIST;
+        break;
+      }
+      k = head[up];
+    }
+
+    if (d < INFINITE_DIST) {
+      if (d < best_dist) {
+        best = a;
+        best_dist = d;
+      }
+      // Remember the distances along the walk
+      for (k = j; timestamp[k] != time; k = head[parent[k]]) {
+        timestamp[k] = time;
+        dist[k] = d--;
+      }
+    }
+  }
+
+  parent[i] = best;
+  if (best != NO_PARENT) {
+    timestamp[i] = time;
+    dist[i] = best_dist + 1;
+    return;
+  }
+
+  // No parent: i leaves the tree. Neighbours that could grow into it
+  // become active, and its children become orphans.
+  for (arc_id a = first[i]; a >= 0; a = next[a]) {
+    node_id j = head[a];
+    arc_id up = parent[j];
+    if (is_sink[j] != sink || up == NO_PARENT)
+      continue;
+    if (residual[sink ? a : sister(a)] > 0)
+      set_active(j);
+    if (up != TERMINAL && up != ORPHAN && head[up] == i)
+      set_orphan(j);
+  }
+}
+
+void MaxFlowGraph::adopt_orphans() {
+  for (size_t k = 0; k < orphans.size(); k++)
+    // A node orphaned and then made a root by init_from_trees keeps its root
+    if (parent[orphans[k]] == ORPHAN)
+      adopt(orphans[k]);
+  orphans.clear();
+}
+
+bool MaxFlowGraph::parent_arc_valid(node_id i) const {
+  arc_id a = parent[i];
+  return residual[is_sink[i] ? a : sister(a)] > 0;
+}
+
+void MaxFlowGraph::orphan_children(node_id i) {
+  for (arc_id a = first[i]; a >= 0; a = next[a]) {
+    node_id j = head[a];
+    if (parent[j] == sister(a))
+      set_orphan(j);
+  }
+}
+
+void MaxFlowGraph::init_from_terminals() {
+  int n = num_nodes();
+
+  // Every node with a terminal residual roots a tree
+  time = 0;
+  for (node_id i = 0; i < n; i++) {
+    next_active[i] = -1;
+    timestamp[i] = 0;
+    if (terminal_cap[i] != 0) {
+      is_sink[i] = terminal_cap[i] < 0;
+      parent[i] = TERMINAL;
+      dist[i] = 1;
+      set_active(i);
+    } else {
+      parent[i] = NO_PARENT;
+    }
+  }
+}
+
+void MaxFlowGraph::init_from_trees() {
+  // Distances are only compared within a run of timestamps, so start
+  // them over well before time can wrap
+  if (time > INT_MAX / 2) {
+    fill(timestamp.begin(), timestamp.end(), 0);
+    time = 0;
+  }
+  time++;
+
+  // Only the changed nodes can have gained a path. Each becomes active,
+  // and roots its tree if it has a terminal residual. Nodes whose tree is
+  // no longer held up become orphans.
+  for (node_id i : changed) {
+    is_marked[i] = 0;
+    arc_id up = parent[i];
+    if (terminal_cap[i] != 0) {
+      bool sink = terminal_cap[i] < 0;
+      if (up == NO_PARENT || is_sink[i] != sink) {
+        if (up != NO_PARENT)
+          orphan_children(i);
+        // Nodes of the other tree that were done growing may now reach i
+        for (arc_id a = first[i]; a >= 0; a = next[a])
+          if (parent[head[a]] != NO_PARENT)
+            set_active(head[a]);
+      }
+      is_sink[i] = sink;
+      parent[i] = TERMINAL;
+      timestamp[i] = time;
+      dist[i] = 1;
+    } else if (up == TERMINAL || up == ORPHAN || (up >= 0 && !parent_arc_valid(i))) {
+      set_orphan(i);
+    }
+    set_active(i);
+  }
+  changed.clear();
+
+  adopt_orphans();
+}
+
+long long MaxFlowGraph::max_flow(bool reuse_trees) {
+  active_first = -1;
+  active_last = -1;
+  if (reuse_trees && solved) {
+    init_from_trees();
+  } else {
+    for (node_id i : changed)
+      is_marked[i] = 0;
+    changed.clear();
+    init_from_terminals();
+  }
+  solved = true;
+
+  node_id current = -1;
+  while (true) {
+    node_id i = current;
+    if (i >= 0) {
+      next_active[i] = -1;
+      if (parent[i] == NO_PARENT)
+        i = -1;
+    }
+    if (i < 0 && (i = pop_active()) < 0)
+      break;
+
+    // Grow the tree of i until it touches the other one
+    arc_id middle = -1;
+    if (!is_sink[i]) {
+      for (arc_id a = first[i]; a >= 0; a = next[a]) {
+        if (residual[a] == 0)
+          continue;
+        node_id j = head[a];
+        if (parent[j] == NO_PARENT) {
+          is_sink[j] = 0;
+          parent[j] = sister(a);
+          timestamp[j] = timestamp[i];
+          dist[j] = dist[i] + 1;
+          set_active(j);
+        } else if (is_sink[j]) {
+          middle = a;
+          break;
+        } else if (timestamp[j] <= timestamp[i] && dist[j] > dist[i]) {
+          // Shorter path to the source through i
+          parent[j] = sister(a);
+          timestamp[j] = timestamp[i];
+          dist[j] = dist[i] + 1;
+        }
+      }
+    } else {
+      for (arc_id a = first[i]; a >= 0; a = next[a]) {
+        if (residual[sister(a)] == 0)
+          continue;
+        node_id j = head[a];
+        if (parent[j] == NO_PARENT) {
+          is_sink[j] = 1;
+          parent[j] = sister(a);
+          timestamp[j] = timestamp[i];
+          dist[j] = dist[i] + 1;
+          set_active(j);
+        } else if (!is_sink[j]) {
+          middle = sister(a);
+          break;
+        } else if (timestamp[j] <= timestamp[i] && dist[j] > dist[i]) {
+          parent[j] = sister(a);
+          timestamp[j] = timestamp[i];
+          dist[j] = dist[i] + 1;
+        }
+      }
+    }
+
+    time++;
+
+    if (middle < 0) {
+      current = -1;
+      continue;
+    }
+
+    // Keep i out of the queue while it is current, it is grown again next
+    next_active[i] = i;
+    current = i;
+
+    augment(middle);
+    adopt_orphans();
+  }
+
+  return flow;
+}
+
+bool MaxFlowGraph::in_source_segment(node_id i) const {
+  return parent[i] != NO_PARENT && !is_sink[i];
+}
+
+MaxFlowGraph::capacity MaxFlowGraph::edge_residual(edge_id e, bool reverse) const {
+  return residual[2 * e + (reverse ? 1 : 0)];
+}
+
+MaxFlowGraph::capacity MaxFlowGraph::terminal_residual(node_id i) const {
+  return terminal_cap[i];
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <vector>
+
+/**
+ * A graph for one min-cut, solved with the Boykov-Kolmogorov augmenting
+ * path algorithm.
+ *
+ * Nodes and arcs are kept as structures of arrays. The two arcs of an
+ * edge sit next to each other in one flat arena, so the reverse of arc a
+ * is a ^ 1. Terminal edges are not arcs: each node keeps its residual
+ * capacity to the source (positive) or to the sink (negative).
+ *
+ * reserve sizes the arrays once, and reset empties the graph without
+ * giving their memory back, so the graph can be rebuilt for every
+ * expansion without allocating.
+ *
+ * A solved graph can also be changed in place and solved again (Kohli and
+ * Torr's dynamic graph cuts). set_terminal_weights and set_edge keep the
+ * flow already pushed, reparameterizing where a new capacity is below it,
+ * and max_flow(true) regrows the search trees only around the nodes they
+ * touched.
+ */
+class MaxFlowGraph {
+public:
+  typedef int node_id;
+  typedef int edge_id;
+  typedef int capacity;
+
+  /** Make room for num_nodes nodes and num_edges edges (2 * num_edges arcs) */
+  void reserve(int num_nodes, int num_edges);
+
+  /** Drop all nodes and edges, keeping the memory */
+  void reset();
+
+  /** Nodes are numbered from 0 in the order they are added */
+  node_id add_node();
+  int num_nodes() const;
+  int num_edges() const;
+
+  /** Add to the capacities of the edges source -> i and i -> sink */
+  void add_terminal_weights(node_id i, capacity source, capacity sink);
+
+  /**
+   * Add the edges i -> j and j -> i. An INT_MAX capacity behaves as
+   * infinite: pushing flow back never raises a residual past it.
+   * Edges are numbered from 0 in the order they are added.
+   */
+  edge_id add_edge(node_id i, node_id j, capacity cap, capacity rev_cap);
+
+  /**
+   * Replace the capacities of the edges source -> i and i -> sink.
+   * Unlike add_terminal_weights this may be called after max_flow.
+   */
+  void set_terminal_weights(node_id i, capacity source, capacity sink);
+
+  /**
+   * Make edge e join i -> j and j -> i with the given capacities. It may be
+   * called after max_flow, and may move the edge to other nodes.
+   */
+  void set_edge(edge_id e, node_id i, node_id j, capacity cap, capacity rev_cap);
+  /** set_edge keeping the nodes edge e joins */
+  void set_edge_capacity(edge_id e, capacity cap, capacity rev_cap);
+
+  /**
+   * Compute the maximum flow, which is also the cost of the min cut.
+   * With reuse_trees, carry on from the flow and search trees of the last
+   * call, which must have been on this graph since the last reset.
+   */
+  long long max_flow(bool reuse_trees = false);
+
+  /**
+   * After max_flow, whether i is reachable from the source in the
+   * residual graph. Nodes that are not end up on the sink side of the cut.
+   */
+  bool in_source_segment(node_id i) const;
+
+  /**
+   * After max_flow, the residual capacity of edge e from i to j, or from
+   * j back to i with reverse
+   */
+  capacity edge_residual(edge_id e, bool reverse = false) const;
+  /**
+   * After max_flow, the residual capacity of source -> i if positive, or
+   * minus that of i -> sink
+   */
+  capacity terminal_residual(node_id i) const;
+
+private:
+  typedef int arc_id;
+
+  /** Parent arcs that do not lead to another node */
+  static const arc_id NO_PARENT = -1;
+  static const arc_id TERMINAL = -2;
+  static const arc_id ORPHAN = -3;
+
+  /*********
+   * Nodes *
+   *********/
+
+  /** Last arc added out of the node, the start of its arc list */
+  std::vector<arc_id> first;
+  /**
+   * Arc from the node to its parent in the search tree, or one of
+   * NO_PARENT (a free node), TERMINAL or ORPHAN
+   */
+  std::vector<arc_id> parent;
+  /** Next node in the active queue, the node itself at the end, -1 if out */
+  std::vector<node_id> next_active;
+  /** Time the distance to the terminal was last checked, and that distance */
+  std::vector<int> timestamp;
+  std::vector<int> dist;
+  /** Tree the node belongs to when it has a parent */
+  std::vector<char> is_sink;
+  /** Residual to the source if positive, to the sink if negative */
+  std::vector<capacity> terminal_cap;
+  /** Terminal capacities as last given, before any flow */
+  std::vector<capacity> source_weight, sink_weight;
+  /** Whether the node was changed since the last max_flow */
+  std::vector<char> is_marked;
+
+  /********
+   * Arcs *
+   ********/
+
+  std::vector<node_id> head;
+  /** Next arc out of the same node */
+  std::vector<arc_id> next;
+  std::vector<capacity> residual;
+  /** Capacity as last given */
+  std::vector<capacity> arc_cap;
+
+  /*********
+   * Edges *
+   *********/
+
+  /**
+   * Flow over a capacity that set_edge lowered stays put: the capacity
+   * of the edge's first arc is raised by shift and that of the second
+   * lowered by it, with shift added to source -> tail and head -> sink
+   * to keep the cuts in order
+   */
+  std::vector<capacity> shift;
+  /**
+   * Net flow along the first arc of each edge. The residuals cannot give
+   * it back once both capacities are infinite.
+   */
+  std::vector<long long> edge_flow;
+
+  static arc_id sister(arc_id a) { return a ^ 1; }
+
+  /** Net flow along arc a, negative when it runs the other way */
+  long long arc_flow(arc_id a) const {
+    return (a & 1) ? -edge_flow[a / 2] : edge_flow[a / 2];
+  }
+  /** Count f more flow along arc a */
+  void add_arc_flow(arc_id a, capacity f) {
+    edge_flow[a / 2] += (a & 1) ? -f : f;
+  }
+  /** Take arc a out of the arc list of the node it leaves */
+  void unlink_arc(arc_id a);
+
+  /*******************
+   * Dynamic updates *
+   *******************/
+
+  /** Whether max_flow has run since the last reset */
+  bool solved = false;
+  /** Nodes changed since the last max_flow */
+  std::vector<node_id> changed;
+  void mark(node_id i);
+
+  /** Add to the terminal residuals of i without changing its weights */
+  void shift_terminal(node_id i, capacity source, capacity sink);
+
+  /**
+   * Whether the parent arc of i still leaves i and can carry flow
+   * towards i's terminal
+   */
+  bool parent_arc_valid(node_id i) const;
+  /** Make orphans of the children of i */
+  void orphan_children(node_id i);
+
+  /** Start max_flow from the trees of the last run */
+  void init_from_trees();
+  /** Start max_flow from every node with a terminal residual */
+  void init_from_terminals();
+
+  /************
+   * Max flow *
+   ************/
+
+  long long flow = 0;
+  int time = 0;
+
+  node_id active_first = -1;
+  node_id active_last = -1;
+  void set_active(node_id i);
+  /** Pop the next active node that still has a parent, or -1 */
+  node_id pop_active();
+
+  /** Nodes cut off from their tree by the last augmentation */
+  std::vector<node_id> orphans;
+  void set_orphan(node_id i);
+
+  /** Push the bottleneck along source -> tail(a) -> head(a) -> sink */
+  void augment(arc_id middle);
+
+  /** Find orphan i a new parent in its tree, or free it */
+  void adopt(node_id i);
+  void adopt_orphans();
+};
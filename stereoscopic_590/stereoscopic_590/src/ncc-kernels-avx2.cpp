@@ -0,0 +1,104 @@
+#include "ncc-kernels.h"
+#include <immintrin.h>
+
+/**
+ * Eight floats at a time. Built with -mavx2 and only called once
+ * ncc_kernels() has seen the CPU support it. No fused multiply-adds: they
+ * round differently and would flip near ties between disparities.
+ */
+
+static void correlate(const float *t, int w, const float *strip, float *out, int n) {
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m256 sum = _mm256_loadu_ps(out + x);
+    for (int v = 0; v < w; v++)
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(t[v]), _mm256_loadu_ps(strip + x + v)));
+    _mm256_storeu_ps(out + x, sum);
+  }
+  for (; x < n; x++) {
+    float sum = out[x];
+    for (int v = 0; v < w; v++)
+      sum += t[v] * strip[x + v];
+    out[x] = sum;
+  }
+}
+
+static void normalize(const float *sum, const float *magnitude, float weight,
+    float *detection, int n) {
+  __m256 wv = _mm256_set1_ps(weight);
+  __m256 zero = _mm256_setzero_ps();
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m256 m = _mm256_loadu_ps(magnitude + x);
+    // Dividing by zero is masked off afterwards
+    __m256 q = _mm256_and_ps(_mm256_cmp_ps(m, zero, _CMP_NEQ_UQ),
+      _mm256_div_ps(_mm256_loadu_ps(sum + x), m));
+    _mm256_storeu_ps(detection + x, _mm256_add_ps(_mm256_loadu_ps(detection + x), _mm256_mul_ps(wv, q)));
+  }
+  for (; x < n; x++)
+    detection[x] += weight * (magnitude[x] != 0 ? sum[x] / magnitude[x] : 0.0f);
+}
+
+static void mul_add(const float *a, const float *b, float *acc, int n) {
+  int m = 0;
+  for (; m + 8 <= n; m += 8) {
+    __m256 p = _mm256_mul_ps(_mm256_loadu_ps(a + m), _mm256_loadu_ps(b + m));
+    _mm256_storeu_ps(acc + m, _mm256_add_ps(_mm256_loadu_ps(acc + m), p));
+  }
+  for (; m < n; m++)
+    acc[m] += a[m] * b[m];
+}
+
+static void mul_add_sub(const float *a_in, const float *b_in,
+    const float *a_out, const float *b_out, float *acc, int n) {
+  int m = 0;
+  for (; m + 8 <= n; m += 8) {
+    __m256 p_in = _mm256_mul_ps(_mm256_loadu_ps(a_in + m), _mm256_loadu_ps(b_in + m));
+    __m256 p_out = _mm256_mul_ps(_mm256_loadu_ps(a_out + m), _mm256_loadu_ps(b_out + m));
+    _mm256_storeu_ps(acc + m, _mm256_add_ps(_mm256_loadu_ps(acc + m), _mm256_sub_ps(p_in, p_out)));
+  }
+  for (; m < n; m++)
+    acc[m] += a_in[m] * b_in[m] - a_out[m] * b_out[m];
+}
+
+static void score(const float *window, float inv_n,
+    const float *ref_mean, const float *ref_inv_std,
+    const float *target_mean, const float *target_inv_std,
+    float *score, int n) {
+  __m256 inv_nv = _mm256_set1_ps(inv_n);
+  int m = 0;
+  for (; m + 8 <= n; m += 8) {
+    __m256 cov = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(window + m), inv_nv),
+      _mm256_mul_ps(_mm256_loadu_ps(ref_mean + m), _mm256_loadu_ps(target_mean + m)));
+    _mm256_storeu_ps(score + m, _mm256_mul_ps(_mm256_mul_ps(cov, _mm256_loadu_ps(ref_inv_std + m)),
+      _mm256_loadu_ps(target_inv_std + m)));
+  }
+  for (; m < n; m++) {
+    score[m] = (window[m] * inv_n - ref_mean[m] * target_mean[m])
+      * ref_inv_std[m] * target_inv_std[m];
+  }
+}
+
+static void keep_best(const float *score, int d, float *best, int *best_d, int n) {
+  __m256i dv = _mm256_set1_epi32(d);
+  int m = 0;
+  for (; m + 8 <= n; m += 8) {
+    __m256 s = _mm256_loadu_ps(score + m);
+    __m256 b = _mm256_loadu_ps(best + m);
+    __m256 better = _mm256_cmp_ps(s, b, _CMP_GT_OQ);
+    _mm256_storeu_ps(best + m, _mm256_blendv_ps(b, s, better));
+    __m256i bd = _mm256_loadu_si256((const __m256i*) (best_d + m));
+    bd = _mm256_blendv_epi8(bd, dv, _mm256_castps_si256(better));
+    _mm256_storeu_si256((__m256i*) (best_d + m), bd);
+  }
+  for (; m < n; m++) {
+    if (score[m] > best[m]) {
+      best[m] = score[m];
+      best_d[m] = d;
+    }
+  }
+}
+
+extern const NCCKernels ncc_kernels_avx2 = {
+  "avx2", correlate, normalize, mul_add, mul_add_sub, score, keep_best
+};
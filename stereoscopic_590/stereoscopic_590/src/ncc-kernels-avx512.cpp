@@ -0,0 +1,91 @@
+#include "ncc-kernels.h"
+#include <immintrin.h>
+
+/**
+ * Sixteen floats at a time, with the tails handled by masked loads and
+ * stores. Built with -mavx512f and only called once ncc_kernels() has
+ * seen the CPU support it. -mavx512f brings in fused multiply-adds too,
+ * so -ffp-contract=off keeps the compiler from fusing the products and
+ * sums below, which would round them unlike the scalar code.
+ */
+
+/** Lanes [0, n) of a 16 lane vector, n <= 16 */
+static inline __mmask16 tail_mask(int n) {
+  return (__mmask16) ((1u << n) - 1);
+}
+
+static void correlate(const float *t, int w, const float *strip, float *out, int n) {
+  for (int x = 0; x < n; x += 16) {
+    __mmask16 k = tail_mask(n - x < 16 ? n - x : 16);
+    __m512 sum = _mm512_maskz_loadu_ps(k, out + x);
+    for (int v = 0; v < w; v++)
+      sum = _mm512_add_ps(sum,
+        _mm512_mul_ps(_mm512_set1_ps(t[v]), _mm512_maskz_loadu_ps(k, strip + x + v)));
+    _mm512_mask_storeu_ps(out + x, k, sum);
+  }
+}
+
+static void normalize(const float *sum, const float *magnitude, float weight,
+    float *detection, int n) {
+  __m512 wv = _mm512_set1_ps(weight);
+  for (int x = 0; x < n; x += 16) {
+    __mmask16 k = tail_mask(n - x < 16 ? n - x : 16);
+    __m512 m = _mm512_maskz_loadu_ps(k, magnitude + x);
+    // Only divide where the magnitude is not zero
+    __mmask16 nonzero = _mm512_mask_cmp_ps_mask(k, m, _mm512_setzero_ps(), _CMP_NEQ_UQ);
+    __m512 q = _mm512_maskz_div_ps(nonzero, _mm512_maskz_loadu_ps(k, sum + x), m);
+    __m512 det = _mm512_add_ps(_mm512_maskz_loadu_ps(k, detection + x), _mm512_mul_ps(wv, q));
+    _mm512_mask_storeu_ps(detection + x, k, det);
+  }
+}
+
+static void mul_add(const float *a, const float *b, float *acc, int n) {
+  for (int m = 0; m < n; m += 16) {
+    __mmask16 k = tail_mask(n - m < 16 ? n - m : 16);
+    __m512 p = _mm512_mul_ps(_mm512_maskz_loadu_ps(k, a + m), _mm512_maskz_loadu_ps(k, b + m));
+    _mm512_mask_storeu_ps(acc + m, k, _mm512_add_ps(_mm512_maskz_loadu_ps(k, acc + m), p));
+  }
+}
+
+static void mul_add_sub(const float *a_in, const float *b_in,
+    const float *a_out, const float *b_out, float *acc, int n) {
+  for (int m = 0; m < n; m += 16) {
+    __mmask16 k = tail_mask(n - m < 16 ? n - m : 16);
+    __m512 p_in = _mm512_mul_ps(_mm512_maskz_loadu_ps(k, a_in + m),
+      _mm512_maskz_loadu_ps(k, b_in + m));
+    __m512 p_out = _mm512_mul_ps(_mm512_maskz_loadu_ps(k, a_out + m),
+      _mm512_maskz_loadu_ps(k, b_out + m));
+    __m512 delta = _mm512_sub_ps(p_in, p_out);
+    _mm512_mask_storeu_ps(acc + m, k, _mm512_add_ps(_mm512_maskz_loadu_ps(k, acc + m), delta));
+  }
+}
+
+static void score(const float *window, float inv_n,
+    const float *ref_mean, const float *ref_inv_std,
+    const float *target_mean, const float *target_inv_std,
+    float *score, int n) {
+  __m512 inv_nv = _mm512_set1_ps(inv_n);
+  for (int m = 0; m < n; m += 16) {
+    __mmask16 k = tail_mask(n - m < 16 ? n - m : 16);
+    __m512 cov = _mm512_sub_ps(_mm512_mul_ps(_mm512_maskz_loadu_ps(k, window + m), inv_nv),
+      _mm512_mul_ps(_mm512_maskz_loadu_ps(k, ref_mean + m), _mm512_maskz_loadu_ps(k, target_mean + m)));
+    __m512 s = _mm512_mul_ps(_mm512_mul_ps(cov, _mm512_maskz_loadu_ps(k, ref_inv_std + m)),
+      _mm512_maskz_loadu_ps(k, target_inv_std + m));
+    _mm512_mask_storeu_ps(score + m, k, s);
+  }
+}
+
+static void keep_best(const float *score, int d, float *best, int *best_d, int n) {
+  __m512i dv = _mm512_set1_epi32(d);
+  for (int m = 0; m < n; m += 16) {
+    __mmask16 k = tail_mask(n - m < 16 ? n - m : 16);
+    __m512 s = _mm512_maskz_loadu_ps(k, score + m);
+    __mmask16 better = _mm512_mask_cmp_ps_mask(k, s, _mm512_maskz_loadu_ps(k, best + m), _CMP_GT_OQ);
+    _mm512_mask_storeu_ps(best + m, better, s);
+    _mm512_mask_storeu_epi32(best_d + m, better, dv);
+  }
+}
+
+extern const NCCKernels ncc_kernels_avx512 = {
+  "avx512", correlate, normalize, mul_add, mul_add_sub, score, keep_best
+};
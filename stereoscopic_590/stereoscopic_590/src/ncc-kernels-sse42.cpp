@@ -0,0 +1,101 @@
+#include "ncc-kernels.h"
+#include <nmmintrin.h>
+
+/**
+ * Four floats at a time. Built with -msse4.2 and only called once
+ * ncc_kernels() has seen the CPU support it.
+ */
+
+static void correlate(const float *t, int w, const float *strip, float *out, int n) {
+  int x = 0;
+  for (; x + 4 <= n; x += 4) {
+    __m128 sum = _mm_loadu_ps(out + x);
+    for (int v = 0; v < w; v++)
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(t[v]), _mm_loadu_ps(strip + x + v)));
+    _mm_storeu_ps(out + x, sum);
+  }
+  for (; x < n; x++) {
+    float sum = out[x];
+    for (int v = 0; v < w; v++)
+      sum += t[v] * strip[x + v];
+    out[x] = sum;
+  }
+}
+
+static void normalize(const float *sum, const float *magnitude, float weight,
+    float *detection, int n) {
+  __m128 wv = _mm_set1_ps(weight);
+  __m128 zero = _mm_setzero_ps();
+  int x = 0;
+  for (; x + 4 <= n; x += 4) {
+    __m128 m = _mm_loadu_ps(magnitude + x);
+    // Dividing by zero is masked off afterwards
+    __m128 q = _mm_and_ps(_mm_cmpneq_ps(m, zero), _mm_div_ps(_mm_loadu_ps(sum + x), m));
+    _mm_storeu_ps(detection + x, _mm_add_ps(_mm_loadu_ps(detection + x), _mm_mul_ps(wv, q)));
+  }
+  for (; x < n; x++)
+    detection[x] += weight * (magnitude[x] != 0 ? sum[x] / magnitude[x] : 0.0f);
+}
+
+static void mul_add(const float *a, const float *b, float *acc, int n) {
+  int m = 0;
+  for (; m + 4 <= n; m += 4) {
+    __m128 p = _mm_mul_ps(_mm_loadu_ps(a + m), _mm_loadu_ps(b + m));
+    _mm_storeu_ps(acc + m, _mm_add_ps(_mm_loadu_ps(acc + m), p));
+  }
+  for (; m < n; m++)
+    acc[m] += a[m] * b[m];
+}
+
+static void mul_add_sub(const float *a_in, const float *b_in,
+    const float *a_out, const float *b_out, float *acc, int n) {
+  int m = 0;
+  for (; m + 4 <= n; m += 4) {
+    __m128 p_in = _mm_mul_ps(_mm_loadu_ps(a_in + m), _mm_loadu_ps(b_in + m));
+    __m128 p_out = _mm_mul_ps(_mm_loadu_ps(a_out + m), _mm_loadu_ps(b_out + m));
+    _mm_storeu_ps(acc + m, _mm_add_ps(_mm_loadu_ps(acc + m), _mm_sub_ps(p_in, p_out)));
+  }
+  for (; m < n; m++)
+    acc[m] += a_in[m] * b_in[m] - a_out[m] * b_out[m];
+}
+
+static void score(const float *window, float inv_n,
+    const float *ref_mean, const float *ref_inv_std,
+    const float *target_mean, const float *target_inv_std,
+    float *score, int n) {
+  __m128 inv_nv = _mm_set1_ps(inv_n);
+  int m = 0;
+  for (; m + 4 <= n; m += 4) {
+    __m128 cov = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(window + m), inv_nv),
+      _mm_mul_ps(_mm_loadu_ps(ref_mean + m), _mm_loadu_ps(target_mean + m)));
+    _mm_storeu_ps(score + m, _mm_mul_ps(_mm_mul_ps(cov, _mm_loadu_ps(ref_inv_std + m)),
+      _mm_loadu_ps(target_inv_std + m)));
+  }
+  for (; m < n; m++) {
+    score[m] = (window[m] * inv_n - ref_mean[m] * target_mean[m])
+      * ref_inv_std[m] * target_inv_std[m];
+  }
+}
+
+static void keep_best(const float *score, int d, float *best, int *best_d, int n) {
+  __m128 dv = _mm_castsi128_ps(_mm_set1_epi32(d));
+  int m = 0;
+  for (; m + 4 <= n; m += 4) {
+    __m128 s = _mm_loadu_ps(score + m);
+    __m128 b = _mm_loadu_ps(best + m);
+    __m128 better = _mm_cmpgt_ps(s, b);
+    _mm_storeu_ps(best + m, _mm_blendv_ps(b, s, better));
+    __m128 bd = _mm_loadu_ps((const float*) (best_d + m));
+    _mm_storeu_ps((float*) (best_d + m), _mm_blendv_ps(bd, dv, better));
+  }
+  for (; m < n; m++) {
+    if (score[m] > best[m]) {
+      best[m] = score[m];
+      best_d[m] = d;
+    }
+  }
+}
+
+extern const NCCKernels ncc_kernels_sse42 = {
+  "sse42", correlate, normalize, mul_add, mul_add_sub, score, keep_best
+};
@@ -0,0 +1,112 @@
+#include "ncc-kernels.h"
+#include <atomic>
+
+using namespace std;
+
+/******************
+ * Scalar kernels *
+ ******************/
+
+static void correlate(const float *t, int w, const float *strip, float *out, int n) {
+  for (int x = 0; x < n; x++) {
+    float sum = out[x];
+    for (int v = 0; v < w; v++)
+      sum += t[v] * strip[x + v];
+    out[x] = sum;
+  }
+}
+
+static void normalize(const float *sum, const float *magnitude, float weight,
+    float *detection, int n) {
+  for (int x = 0; x < n; x++)
+    detection[x] += weight * (magnitude[x] != 0 ? sum[x] / magnitude[x] : 0.0f);
+}
+
+static void mul_add(const float *a, const float *b, float *acc, int n) {
+  for (int m = 0; m < n; m++)
+    acc[m] += a[m] * b[m];
+}
+
+static void mul_add_sub(const float *a_in, const float *b_in,
+    const float *a_out, const float *b_out, float *acc, int n) {
+  for (int m = 0; m < n; m++)
+    acc[m] += a_in[m] * b_in[m] - a_out[m] * b_out[m];
+}
+
+static void score(const float *window, float inv_n,
+    const float *ref_mean, const float *ref_inv_std,
+    const float *target_mean, const float *target_inv_std,
+    float *score, int n) {
+  for (int m = 0; m < n; m++) {
+    score[m] = (window[m] * inv_n - ref_mean[m] * target_mean[m])
+      * ref_inv_std[m] * target_inv_std[m];
+  }
+}
+
+static void keep_best(const float *score, int d, float *best, int *best_d, int n) {
+  for (int m = 0; m < n; m++) {
+    if (score[m] > best[m]) {
+      best[m] = score[m];
+      best_d[m] = d;
+    }
+  }
+}
+
+extern const NCCKernels ncc_kernels_scalar = {
+  "scalar", correlate, normalize, mul_add, mul_add_sub, score, keep_best
+};
+
+/************
+ * Dispatch *
+ ************/
+
+#ifdef X86_KERNELS
+extern const NCCKernels ncc_kernels_sse42;
+extern const NCCKernels ncc_kernels_avx2;
+extern const NCCKernels ncc_kernels_avx512;
+#endif
+
+/** The variant called name if the CPU runs it, else nullptr */
+static const NCCKernels* find_kernels(const string &name) {
+  if (name == "scalar")
+    return &ncc_kernels_scalar;
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+  if (name == "sse42" && __builtin_cpu_supports("sse4.2"))
+    return &ncc_kernels_sse42;
+  if (name == "avx2" && __builtin_cpu_supports("avx2"))
+    return &ncc_kernels_avx2;
+  if (name == "avx512" && __builtin_cpu_supports("avx512f"))
+    return &ncc_kernels_avx512;
+#endif
+  return nullptr;
+}
+
+static const NCCKernels& best_kernels() {
+  const char *order[] = {"avx512", "avx2", "sse42"};
+  for (const char *name : order) {
+    const NCCKernels *kernels = find_kernels(name);
+    if (kernels)
+      return *kernels;
+  }
+  return ncc_kernels_scalar;
+}
+
+static atomic<const NCCKernels*> selected(nullptr);
+
+const NCCKernels& ncc_kernels() {
+  const NCCKernels *kernels = selected.load(memory_order_acquire);
+  if (!kernels) {
+    kernels = &best_kernels();
+    selected.store(kernels, memory_order_release);
+  }
+  return *kernels;
+}
+
+bool select_ncc_kernels(const string &name) {
+  const NCCKernels *kernels = (name == "auto") ? &best_kernels() : find_kernels(name);
+  if (!kernels)
+    return false;
+  selected.store(kernels, memory_order_release);
+  return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+
+/**
+ * Inner loops of NCCDisparity, built once per instruction set.
+ *
+ * Every variant computes exactly the values the scalar one does, with the
+ * same operations in the same order and no fused multiply-adds, so they
+ * all give the same disparity maps. All pointers may be unaligned.
+ */
+struct NCCKernels {
+  const char *name;
+
+  /** out[x] += sum over v < w of t[v] * strip[x + v], for x < n */
+  void (*correlate)(const float *t, int w, const float *strip, float *out, int n);
+
+  /**
+   * detection[x] += weight * sum[x] / magnitude[x], for x < n. Pixels of
+   * zero magnitude add nothing.
+   */
+  void (*normalize)(const float *sum, const float *magnitude, float weight,
+    float *detection, int n);
+
+  /** acc[m] += a[m] * b[m], for m < n */
+  void (*mul_add)(const float *a, const float *b, float *acc, int n);
+
+  /** acc[m] += a_in[m] * b_in[m] - a_out[m] * b_out[m], for m < n */
+  void (*mul_add_sub)(const float *a_in, const float *b_in,
+    const float *a_out, const float *b_out, float *acc, int n);
+
+  /**
+   * NCC of window sums of cross products, for m < n. score may alias
+   * window.
+   *
+   * score = (window[m] * inv_n - ref_mean[m] * target_mean[m])
+   *           * ref_inv_std[m] * target_inv_std[m]
+   */
+  void (*score)(const float *window, float inv_n,
+    const float *ref_mean, const float *ref_inv_std,
+    const float *target_mean, const float *target_inv_std,
+    float *score, int n);
+
+  /** Keep d in best_d where score beats best, for m < n */
+  void (*keep_best)(const float *score, int d, float *best, int *best_d, int n);
+};
+
+/**
+ * The kernels NCCDisparity uses. The first call picks the widest variant
+ * the CPU supports.
+ */
+const NCCKernels& ncc_kernels();
+
+/**
+ * Use the variant called name ("scalar", "sse42", "avx2" or "avx512"), or
+ * the best supported one for "auto". Returns false, leaving the choice
+ * alone, if the variant is not built in or the CPU does not support it.
+ */
+bool select_ncc_kernels(const std::string &name);
@@ -1,61 +1,95 @@
 #include "ncc.h"
+#include "ncc-kernels.h"
+#include "thread-pool.h"
 #include "opencv2/imgproc/imgproc.hpp"
 #include <iostream>
 #include <vector>
-#include "opencv2/highgui/highgui.hpp"
+#include <algorithm>
+#include <limits>
+#include <cmath>
 
 using namespace std;
 
 /**
- * Return template of window_size centered at (i, j)
+ * Mirror an index that falls off either end of [0, n), leaving the edge
+ * itself out (cv::BORDER_REFLECT_101)
  */
-cv::Mat NCCDisparity::get_template(int i, int j, bool left) {
-  int r = (window_size - 1) /  2;
-  int min_i = i - r;
-  int min_j = j - r;
-
-  cv::Mat t;
-
-  cv::Rect roi(min_j, min_i, window_size, window_size);
-
-  if (left) {
-    pair->left(roi).copyTo(t);
-  } else {
-    pair->right(roi).copyTo(t);
+static inline int reflect_101(int p, int n) {
+  if (n == 1)
+    return 0;
+  while (p < 0 || p >= n) {
+    if (p < 0) p = -p;
+    if (p >= n) p = 2 * n - 2 - p;
   }
+  return p;
+}
 
-  // subtract mean
-  cv::Scalar mean = cv::mean(t);
-  cv::subtract(t, mean, t);
-
-
-  return t;
+/**
+ * Size the per-thread buffers for the current pair
+ */
+void NCCDisparity::allocate_scratch() {
+  // Enough for either search, or both at once through a shared volume
+  int num_d = max(pair->max_disparity_left, pair->max_disparity_right)
+    - min(pair->min_disparity_left, pair->min_disparity_right) + 1;
+  num_d = max(num_d, 0);
+
+  scratch.resize(ThreadPool::shared().concurrency());
+  for (Scratch &s : scratch) {
+    s.templ.assign(3 * window_size * window_size, 0.0f);
+    s.strip.assign(3 * window_size * pair->cols, 0.0f);
+    s.sums.assign(pair->cols, 0.0f);
+    s.detections.assign(pair->cols, 0.0f);
+
+    // A pyramid leaves the running sums to the coarsest level's own search
+    if (options.mode == NCC_RUNNING_SUM && options.levels == 0) {
+      s.col_sums.assign(num_d * 3 * pair->cols, 0.0f);
+      s.col_totals.assign(pair->cols, 0.0f);
+      s.windows.assign(pair->cols, 0.0f);
+      s.best.assign(pair->cols, 0.0f);
+      s.best_d.assign(pair->cols, 0);
+      s.target_best.assign(pair->cols, 0.0f);
+      s.target_best_d.assign(pair->cols, 0);
+    }
+  }
 }
 
 /**
- * Get entire row of height window_size centered at i
+ * Write the template of window_size centered at (i, j) into t, one plane
+ * per channel, with the mean of each channel subtracted
  */
-cv::Mat NCCDisparity::get_row(int i, cv::Mat im) {
+void NCCDisparity::get_template(int i, int j, const cv::Mat &im, float *t) {
   int r = (window_size - 1) /  2;
-  int min_i = i - r;
+  int area = window_size * window_size;
+
+  double mean[3] = {0, 0, 0};
+  for (int u = 0; u < window_size; u++) {
+    const float *p = im.ptr<float>(i - r + u) + (j - r) * 3;
+    for (int v = 0; v < window_size; v++)
+      for (int c = 0; c < 3; c++)
+        mean[c] += p[v * 3 + c];
+  }
+  for (int c = 0; c < 3; c++)
+    mean[c] /= area;
 
-  cv::Rect roi(0, min_i, pair->cols, window_size);
-  return im(roi);
+  // subtract mean
+  for (int u = 0; u < window_size; u++) {
+    const float *p = im.ptr<float>(i - r + u) + (j - r) * 3;
+    for (int v = 0; v < window_size; v++)
+      for (int c = 0; c < 3; c++)
+        t[c * area + u * window_size + v] = p[v * 3 + c] - mean[c];
+  }
 }
 
 /**
- * Calculate disparity of template t within the row.
+ * Calculate disparity of template t within row i of im.
  * Use the search space defined by min_disparity and max_disparity on the StereoPair
  * centered around the template's original location j.
  *
  * left flag determines whether we expect to find the template to the right or left of
  * its original location, and how to report the disparity.
  */
-int NCCDisparity::disparity(cv::Mat t, cv::Mat row, cv::Mat magnitude, int j, bool left) {
-  vector<cv::Mat> row_rgb(3);
-  vector<cv::Mat> t_rgb(3);
-  vector<cv::Mat> detections_rgb(3);
-
+int NCCDisparity::disparity(const float *t, const cv::Mat &im, const vector<cv::Mat> &magnitude,
+    int i, int j, bool left, Scratch &s) {
   // Calculate search region
   int r = (window_size - 1) /  2;
   int min_j, max_j;
@@ -80,49 +114,54 @@ int NCCDisparity::disparity(cv::Mat t, cv::Mat row, cv::Mat magnitude, int j, bo
   if (bounds_width < window_size)
     return 0;
 
-  // Get an ROI of the search region and crop the row to that size
-  cv::Rect bounded_roi(min_j, 0, bounds_width, window_size);  
+  /* Copy the search region into one plane per channel. Correlating the
+   * strip on its own, as cv::filter2D would, mirrors it at its left edge.
+   * Strip column x + v lines up with template column v for the detection
+   * at x.
+   */
+  int area = window_size * window_size;
+  int strip_area = window_size * bounds_width;
+  for (int u = 0; u < window_size; u++) {
+    const float *p = im.ptr<float>(i - r + u);
+    for (int q = 0; q < bounds_width; q++) {
+      const float *px = p + (min_j + reflect_101(q - r, bounds_width)) * 3;
+      for (int c = 0; c < 3; c++)
+        s.strip[c * strip_area + u * bounds_width + q] = px[c];
+    }
+  }
 
-  row = row(bounded_roi);
-  magnitude = magnitude(bounded_roi);
+  /* Since the template is already mean-subtracted, we do not have
+   * to mean-subtract the original image. Also, since we are only comparing
+   * detections from the same template, we do not need to normalize the magnitude
+   * of the template because all detections will be scaled by some constant
+   * factor.
+   */
+  const NCCKernels &kernels = ncc_kernels();
+  // Weights of cv::cvtColor's BGR to gray, averaging the channels
+  static const float gray[3] = {0.114f, 0.587f, 0.299f};
 
-  // Split to perform template matching on each channel individually
-  split(row, row_rgb);
-  split(row, detections_rgb);
-  split(t, t_rgb);
+  int num_x = bounds_width - window_size + 1;
+  float *detections = s.detections.data();
+  fill(detections, detections + num_x, 0.0f);
 
-  // For each image channel
   for (int c = 0; c < 3; c++) {
-    // Get the correlation with the mean-subtracted template
-    cv::filter2D(row_rgb[c], detections_rgb[c], -1, t_rgb[c]);
-    /* Since the template is already mean-subtracted, we do not have
-     * to mean-subtract the original image. Also, since we are only comparing
-     * detections from the same template, we do not need to normalize the magnitude
-     * of the template because all detections will be scaled by some constant
-     * factor.
-     */
-  }
-
-  // Get the 1-pixel tall center stripe that contains the correlation values
-  cv::Mat detections;
-  merge(detections_rgb, detections);
-  cv::Rect roi(0, r, bounds_width - window_size + 1, 1);
-  detections(roi).copyTo(detections);
-
-  /* Divide by the 1-pixel tall stripe of magnitudes
-   * to get the normalized correlation.
-   */
-  cv::divide(detections, magnitude(roi), detections);
+    // Correlation with the mean-subtracted template
+    float *sum = s.sums.data();
+    fill(sum, sum + num_x, 0.0f);
+    for (int u = 0; u < window_size; u++) {
+      kernels.correlate(t + c * area + u * window_size, window_size,
+        &s.strip[c * strip_area + u * bounds_width], sum, num_x);
+    }
 
-  // Average the different detection strengths from all color channels
-  cv::cvtColor(detections, detections, CV_BGR2GRAY);
+    // Divide by the magnitude to get the normalized correlation
+    kernels.normalize(sum, magnitude[c].ptr<float>(i) + min_j, gray[c], detections, num_x);
+  }
 
   // Find the maximum
-  cv::Point maxLoc;
-  cv::minMaxLoc(detections, NULL, NULL, NULL, &maxLoc);
+  int best_x = max_element(detections, detections + num_x) - detections;
 
   // Transform from the search region back to the original image coordinates
-  int max_loc_orig = maxLoc.x + min_j + r;
+  int max_loc_orig = best_x + min_j + r;
 
   // disparity = left - right
   if (left) {
@@ -134,33 +173,434 @@ int NCCDisparity::disparity(cv::Mat t, cv::Mat row, cv::Mat magnitude, int j, bo
 
 
 /**
- * Return a matrix of the standard deviation of im
- * within a square region of window_size. This is used
- * for the normalization of the normalized cross correlation.
+ * Standard deviation of im within a square region of window_size, for
+ * the normalization of the normalized cross correlation
  */
-cv::Mat NCCDisparity::get_magnitude(cv::Mat im) {
+void NCCDisparity::get_magnitude(const cv::Mat &im, vector<cv::Mat> &planes) {
   // std = (sum(x^2) - sum(x)^2/n)/n
-  cv::Mat im_sq, mean_sq; // mean of x^2
   cv::pow(im, 2, im_sq);
-  cv::boxFilter(im_sq, mean_sq, -1,
+  cv::boxFilter(im_sq, box_mean_sq, -1,
     cv::Size(window_size, window_size), cv::Point(-1,-1), true, cv::BORDER_CONSTANT);
 
-  cv::Mat mean, sq_mean; // (mean of x)^2
-  cv::boxFilter(im, mean, -1,
+  // (mean of x)^2
+  cv::boxFilter(im, box_mean, -1,
     cv::Size(window_size, window_size), cv::Point(-1,-1), true, cv::BORDER_CONSTANT);
-  cv::pow(mean, 2, sq_mean);
+  cv::pow(box_mean, 2, box_sq_mean);
 
-  cv::Mat var, std_dev;
   // var = mean of x^2 - (mean of x)^2
-  cv::subtract(mean_sq, sq_mean, var);
+  cv::subtract(box_mean_sq, box_sq_mean, variance);
   // std = sqrt(var)
-  cv::sqrt(var, std_dev);
+  cv::sqrt(variance, std_dev);
+
+  cv::split(std_dev, planes);
+}
+
+/*******************
+ * Running-sum NCC *
+ *******************/
+
+void NCCDisparity::get_window_stats(const cv::Mat &im, cv::Mat &mean, cv::Mat &inv_std) {
+  int rows = im.rows;
+  int cols = im.cols;
+  double n = 3.0 * window_size * window_size;
+
+  // The window of cv::boxFilter's default anchor, with zeros outside
+  // the image
+  int before = window_size / 2;
+  int after = window_size - 1 - before;
+
+  mean.create(rows, cols, CV_32F);
+  inv_std.create(rows, cols, CV_32F);
+  stat_sums.assign(cols, 0.0);
+  stat_sq_sums.assign(cols, 0.0);
+
+  // The pixels are whole numbers, so the sums in double are exact and
+  // do not depend on the order they are added in
+  auto add_row = [this, &im, rows, cols](int y, double sign) {
+    if (y < 0 || y >= rows)
+      return;
+    const float *p = im.ptr<float>(y);
+    for (int x = 0; x < cols; x++) {
+      double a = p[3 * x], b = p[3 * x + 1], c = p[3 * x + 2];
+      stat_sums[x] += sign * (a + b + c);
+      stat_sq_sums[x] += sign * (a * a + b * b + c * c);
+    }
+  };
+
+  for (int y = -before; y < after; y++)
+    add_row(y, 1);
+  for (int i = 0; i < rows; i++) {
+    add_row(i + after, 1);
+
+    float *m = mean.ptr<float>(i);
+    float *is = inv_std.ptr<float>(i);
+    double sum = 0, sq_sum = 0;
+    for (int x = 0; x < min(after, cols); x++) {
+      sum += stat_sums[x];
+      sq_sum += stat_sq_sums[x];
+    }
+    for (int j = 0; j < cols; j++) {
+      if (j + after < cols) {
+        sum += stat_sums[j + after];
+        sq_sum += stat_sq_sums[j + after];
+      }
+      double mu = sum / n;
+      // var = mean of x^2 - (mean of x)^2
+      double var = sq_sum / n - mu * mu;
+      m[j] = mu;
+      is[j] = (var > 1e-6) ? 1.0 / std::sqrt(var) : 0.0;
+      if (j - before >= 0) {
+        sum -= stat_sums[j - before];
+        sq_sum -= stat_sq_sums[j - before];
+      }
+    }
+
+    add_row(i - before, -1);
+  }
+}
+
+/**
+ * For every disparity d we keep, per column and channel, the sum of
+ * ref * target over the window_size rows around the current row. Moving
+ * down one row adds the entering row and subtracts the leaving one, and a
+ * sliding sum along the row turns the column sums into window sums, so
+ * the work per (pixel, disparity) does not depend on window_size.
+ *
+ * NCC = (mean(ref * target) - mean(ref) * mean(target))
+ *         / (std(ref) * std(target))
+ */
+void NCCDisparity::running_sum_rows(const RunningSumSearch &search, int row_begin, int row_end,
+    Scratch &s)
+{
+  int cols = search.ref.cols;
+  int r = (window_size - 1) / 2;
+
+  // A shared volume has to cover the disparities of both maps
+  bool shared = !search.target_disparity.empty();
+  int min_d = search.min_d;
+  int max_d = search.max_d;
+  if (shared) {
+    min_d = min(min_d, search.target_min_d);
+    max_d = max(max_d, search.target_max_d);
+  }
+  int num_d = max_d - min_d + 1;
+
+  float inv_n = 1.0f / (3 * window_size * window_size);
+
+  // left: right = left - disparity, right: left = right + disparity
+  int sign = search.left ? -1 : 1;
+
+  const NCCKernels &kernels = ncc_kernels();
+
+  // The band sums its first window from zero
+  fill(s.col_sums.begin(), s.col_sums.begin() + num_d * 3 * cols, 0.0f);
+  vector<float> &col_sums = s.col_sums;
+  vector<float> &col_totals = s.col_totals;
+  vector<float> &windows = s.windows;
+  vector<float> &best = s.best;
+  vector<int> &best_d = s.best_d;
+  vector<float> &target_best = s.target_best;
+  vector<int> &target_best_d = s.target_best_d;
+
+  cv::Mat disparity = search.disparity;
+  cv::Mat target_disparity = search.target_disparity;
+  for (int i = row_begin; i < row_end; i++) {
+    fill(best.begin(), best.end(), -numeric_limits<float>::infinity());
+    fill(best_d.begin(), best_d.end(), 0);
+    if (shared) {
+      fill(target_best.begin(), target_best.end(), -numeric_limits<float>::infinity());
+      fill(target_best_d.begin(), target_best_d.end(), 0);
+    }
+
+    const float *ref_mu = search.ref_mean.ptr<float>(i);
+    const float *ref_is = search.ref_inv_std.ptr<float>(i);
+    const float *target_mu = search.target_mean.ptr<float>(i);
+    const float *target_is = search.target_inv_std.ptr<float>(i);
+
+    for (int k = 0; k < num_d; k++) {
+      int d = min_d + k;
+      int offset = sign * d;
+
+      // Columns c for which both c and c + offset lie in the image
+      int c_min = max(0, -offset);
+      int c_max = min(cols, cols - offset);
+      if (c_max - c_min < window_size)
+        continue;
+
+      float *acc = &col_sums[(k * cols + c_min) * 3];
+      int n = (c_max - c_min) * 3;
+
+      if (i == row_begin) {
+        // First row of the band: sum the whole window
+        for (int y = i - r; y <= i + r; y++) {
+          const float *a = search.ref.ptr<float>(y) + c_min * 3;
+          const float *b = search.target.ptr<float>(y) + (c_min + offset) * 3;
+          kernels.mul_add(a, b, acc, n);
+        }
+      } else {
+        // Slide the window down by one row
+        const float *a_in = search.ref.ptr<float>(i + r) + c_min * 3;
+        const float *b_in = search.target.ptr<float>(i + r) + (c_min + offset) * 3;
+        const float *a_out = search.ref.ptr<float>(i - r - 1) + c_min * 3;
+        const float *b_out = search.target.ptr<float>(i - r - 1) + (c_min + offset) * 3;
+        kernels.mul_add_sub(a_in, b_in, a_out, b_out, acc, n);
+      }
+
+      // Pool the colour channels
+      for (int c = c_min; c < c_max; c++) {
+        const float *col = &col_sums[(k * cols + c) * 3];
+        col_totals[c] = col[0] + col[1] + col[2];
+      }
+
+      // Slide the window along the row
+      int j_min = c_min + r;
+      int j_max = c_max - r;
+      float window = 0;
+      for (int c = c_min; c < c_min + window_size; c++)
+        window += col_totals[c];
+      windows[j_min] = window;
+      for (int j = j_min + 1; j < j_max; j++) {
+        window += col_totals[j + r] - col_totals[j - r - 1];
+        windows[j] = window;
+      }
+
+      // Scores of ref pixels j, which are also the scores of target
+      // pixels j + offset at the same disparity
+      float *scores = &windows[j_min];
+      int n_j = j_max - j_min;
+      kernels.score(scores, inv_n,
+        ref_mu + j_min, ref_is + j_min, target_mu + j_min + offset, target_is + j_min + offset,
+        scores, n_j);
+
+      if (d >= search.min_d && d <= search.max_d)
+        kernels.keep_best(scores, d, &best[j_min], &best_d[j_min], n_j);
+      if (shared && d >= search.target_min_d && d <= search.target_max_d) {
+        kernels.keep_best(scores, d,
+          &target_best[j_min + offset], &target_best_d[j_min + offset], n_j);
+      }
+    }
+
+    uchar *out = disparity.ptr<uchar>(i);
+    for (int j = r; j < cols - r; j++)
+      out[j] = best_d[j];
+
+    if (shared) {
+      uchar *target_out = target_disparity.ptr<uchar>(i);
+      for (int j = r; j < cols - r; j++)
+        target_out[j] = target_best_d[j];
+    }
+
+    // The left search leaves the right map to a search of its own
+    if (shared || !search.left)
+      report_row(*pair, i);
+  }
+}
+
+void NCCDisparity::running_sum_disparity(const RunningSumSearch &search) {
+  int r = (window_size - 1) / 2;
+  int num_rows = search.ref.rows - 2 * r;
+  bool shared = !search.target_disparity.empty();
+  bool empty = search.max_d < search.min_d
+    && (!shared || search.target_max_d < search.target_min_d);
+  if (empty || num_rows <= 0)
+    return;
+
+  // Each band sums its first window from scratch, so keep bands a few
+  // windows tall while still leaving several bands per thread to steal
+  ThreadPool &pool = ThreadPool::shared();
+  int band = max(2 * window_size, num_rows / (4 * pool.concurrency()));
+
+  pool.parallel_for(num_rows, band, [this, &search, r](int begin, int end, int worker) {
+    running_sum_rows(search, r + begin, r + end, scratch[worker]);
+  });
+}
 
-  return std_dev;
+void NCCDisparity::compute_running_sum() {
+  // NCC does not depend on the offset of the intensities, so centre them
+  // to keep the float running sums small and precise
+  pair->left.convertTo(left_float, CV_32FC3, 1, -128);
+  pair->right.convertTo(right_float, CV_32FC3, 1, -128);
+
+  get_window_stats(left_float, mean_left, inv_std_left);
+  get_window_stats(right_float, mean_right, inv_std_right);
+
+  RunningSumSearch search_left;
+  search_left.ref = left_float;
+  search_left.target = right_float;
+  search_left.ref_mean = mean_left;
+  search_left.ref_inv_std = inv_std_left;
+  search_left.target_mean = mean_right;
+  search_left.target_inv_std = inv_std_right;
+  search_left.min_d = pair->min_disparity_left;
+  search_left.max_d = pair->max_disparity_left;
+  search_left.left = true;
+  search_left.disparity = pair->disparity_left;
+
+  if (options.shared_volume) {
+    // One pass over the volume fills in both maps
+    search_left.target_disparity = pair->disparity_right;
+    search_left.target_min_d = pair->min_disparity_right;
+    search_left.target_max_d = pair->max_disparity_right;
+    running_sum_disparity(search_left);
+    return;
+  }
+  running_sum_disparity(search_left);
+
+  RunningSumSearch search_right;
+  search_right.ref = right_float;
+  search_right.target = left_float;
+  search_right.ref_mean = mean_right;
+  search_right.ref_inv_std = inv_std_right;
+  search_right.target_mean = mean_left;
+  search_right.target_inv_std = inv_std_left;
+  search_right.min_d = pair->min_disparity_right;
+  search_right.max_d = pair->max_disparity_right;
+  search_right.left = false;
+  search_right.disparity = pair->disparity_right;
+  running_sum_disparity(search_right);
+}
+
+/***************
+ * NCC pyramid *
+ ***************/
+
+int NCCDisparity::refine_pixel(const PyramidLevel &level, int i, int j, int guess,
+    bool left, Scratch &s) {
+  int r = (window_size - 1) / 2;
+  int cols = pair->cols;
+
+  int min_d = left ? pair->min_disparity_left : pair->min_disparity_right;
+  int max_d = left ? pair->max_disparity_left : pair->max_disparity_right;
+  if (guess > 0) {
+    min_d = max(min_d, 2 * guess - options.band);
+    max_d = min(max_d, 2 * guess + options.band);
+  }
+
+  // Keep the target window inside the image
+  if (left) {
+    // right = left - disparity
+    max_d = min(max_d, j - r);
+    min_d = max(min_d, j + r - cols + 1);
+  } else {
+    // left = right + disparity
+    max_d = min(max_d, cols - 1 - r - j);
+    min_d = max(min_d, r - j);
+  }
+  if (max_d < min_d)
+    return 0;
+
+  // Candidate x is centred on target column first + x
+  int n = max_d - min_d + 1;
+  int first = left ? j - max_d : j + min_d;
+
+  const vector<cv::Mat> &ref = left ? level.left_planes : level.right_planes;
+  const vector<cv::Mat> &target = left ? level.right_planes : level.left_planes;
+  const NCCKernels &kernels = ncc_kernels();
+
+  float *sums = s.sums.data();
+  fill(sums, sums + n, 0.0f);
+  for (int c = 0; c < 3; c++) {
+    for (int u = i - r; u <= i + r; u++) {
+      kernels.correlate(ref[c].ptr<float>(u) + j - r, window_size,
+        target[c].ptr<float>(u) + first - r, sums, n);
+    }
+  }
+
+  const cv::Mat &target_mean = left ? level.mean_right : level.mean_left;
+  const cv::Mat &target_inv_std = left ? level.inv_std_right : level.inv_std_left;
+  const float *mean = target_mean.ptr<float>(i) + first;
+  const float *inv_std = target_inv_std.ptr<float>(i) + first;
+  float ref_mean = (left ? level.mean_left : level.mean_right).at<float>(i, j);
+  float ref_inv_std = (left ? level.inv_std_left : level.inv_std_right).at<float>(i, j);
+  float inv_n = 1.0f / (3 * window_size * window_size);
+
+  float best = -numeric_limits<float>::infinity();
+  int best_x = 0;
+  for (int x = 0; x < n; x++) {
+    float score = (sums[x] * inv_n - ref_mean * mean[x]) * ref_inv_std * inv_std[x];
+    if (score > best) {
+      best = score;
+      best_x = x;
+    }
+  }
+  return left ? max_d - best_x : min_d + best_x;
+}
+
+void NCCDisparity::refine(const cv::Mat &coarse_left, const cv::Mat &coarse_right) {
+  pair->disparity_left = cv::Mat(pair->rows, pair->cols, CV_8U);
+  pair->disparity_right = cv::Mat(pair->rows, pair->cols, CV_8U);
+
+  pair->disparity_left.setTo(0);
+  pair->disparity_right.setTo(0);
+
+  allocate_scratch();
+
+  // Same centring and window statistics as the running-sum search
+  PyramidLevel level;
+  pair->left.convertTo(left_float, CV_32FC3, 1, -128);
+  pair->right.convertTo(right_float, CV_32FC3, 1, -128);
+  get_window_stats(left_float, level.mean_left, level.inv_std_left);
+  get_window_stats(right_float, level.mean_right, level.inv_std_right);
+  cv::split(left_float, level.left_planes);
+  cv::split(right_float, level.right_planes);
+
+  int r = (window_size - 1) / 2;
+  ThreadPool::shared().parallel_for(pair->rows - 2 * r, 4,
+      [this, &level, &coarse_left, &coarse_right, r](int begin, int end, int worker) {
+    Scratch &s = scratch[worker];
+
+    for (int i = r + begin; i < r + end; i++) {
+      int coarse_i = min(i / 2, coarse_left.rows - 1);
+      const uchar *guess_left = coarse_left.ptr<uchar>(coarse_i);
+      const uchar *guess_right = coarse_right.ptr<uchar>(coarse_i);
+      uchar *out_left = pair->disparity_left.ptr<uchar>(i);
+      uchar *out_right = pair->disparity_right.ptr<uchar>(i);
+
+      for (int j = r; j < pair->cols - r; j++) {
+        int coarse_j = min(j / 2, coarse_left.cols - 1);
+        out_left[j] = refine_pixel(level, i, j, guess_left[coarse_j], true, s);
+        out_right[j] = refine_pixel(level, i, j, guess_right[coarse_j], false, s);
+      }
+      report_row(*pair, i);
+    }
+  });
+}
+
+void NCCDisparity::compute_pyramid(StereoPair &full) {
+  // The coarsest level searches everything, the usual way
+  NCCOptions coarse_options = options;
+  coarse_options.levels = 0;
+  coarse_options.left_right_check = false;
+
+  StereoPair coarse = full;
+  coarse.resize(1.0f / (1 << options.levels));
+  NCCDisparity(window_size, coarse_options).compute(coarse);
+
+  // Every finer level is resized straight from the full pair
+  for (int level = options.levels - 1; level >= 0; level--) {
+    StereoPair fine = full;
+    if (level > 0)
+      fine.resize(1.0f / (1 << level));
+    pair = &fine;
+    refine(coarse.disparity_left, coarse.disparity_right);
+    coarse = fine;
+  }
+
+  full.disparity_left = coarse.disparity_left;
+  full.disparity_right = coarse.disparity_right;
+  pair = &full;
 }
 
 NCCDisparity& NCCDisparity::compute(StereoPair &_pair) {
   pair = &_pair;
+  report_start(*pair);
+
+  if (options.levels > 0) {
+    compute_pyramid(*pair);
+    if (options.left_right_check)
+      pair->check_left_right();
+    return *this;
+  }
 
   pair->disparity_left = cv::Mat(pair->rows, pair->cols, CV_8U);
   pair->disparity_right = cv::Mat(pair->rows, pair->cols, CV_8U);
@@ -168,36 +608,49 @@ NCCDisparity& NCCDisparity::compute(StereoPair &_pair) {
   pair->disparity_left.setTo(0);
   pair->disparity_right.setTo(0);
 
-  cv::Mat magnitude_left = get_magnitude(pair->left);
-  cv::Mat magnitude_right = get_magnitude(pair->right);
+  allocate_scratch();
 
+  if (options.mode == NCC_RUNNING_SUM) {
+    compute_running_sum();
+    if (options.left_right_check)
+      pair->check_left_right();
+    return *this;
+  }
+
+  // The filter kernels work on float pixels
+  pair->left.convertTo(left_float, CV_32FC3);
+  pair->right.convertTo(right_float, CV_32FC3);
+
+  // One plane per channel for the normalization kernel
+  get_magnitude(left_float, magnitude_left);
+  get_magnitude(right_float, magnitude_right);
+
+  // Rows only read the images and write their own row of the disparity maps
   int r = (window_size- 1) / 2;
-  for (int i = r; i < (pair->rows - r); i++) {
-    // Print progress
-    if ((i % 20) == 0)
-      cout << i << endl;
-
-    // Get original image row and magnitude of row for normalization
-    cv::Mat row_left = get_row(i, pair->left);
-    cv::Mat row_right = get_row(i, pair->right);
-    cv::Mat mag_row_left = get_row(i, magnitude_left);
-    cv::Mat mag_row_right = get_row(i, magnitude_right);
-
-    // For each pixel in the row, calculate a disparity
-    for (int j = r; j < (pair->cols - r); j++) {
-      // Get a mean-subtracted template
-      cv::Mat t_left = get_template(i, j, true);
-      cv::Mat t_right = get_template(i, j, false);
-
-      // Calculate disparity by NCC
-      int d_left = disparity(t_left, row_right, mag_row_right, j, true);
-      int d_right = disparity(t_right, row_left, mag_row_left, j, false);
-
-      // Save in disparity image
-      pair->disparity_left.at<uchar>(i, j) = d_left;
-      pair->disparity_right.at<uchar>(i, j) = d_right;
+  ThreadPool::shared().parallel_for(pair->rows - 2 * r, 4,
+      [this, r](int begin, int end, int worker) {
+    Scratch &s = scratch[worker];
+    float *t = s.templ.data();
+
+    for (int i = r + begin; i < r + end; i++) {
+      uchar *out_left = pair->disparity_left.ptr<uchar>(i);
+      uchar *out_right = pair->disparity_right.ptr<uchar>(i);
+
+      // For each pixel in the row, calculate a disparity
+      for (int j = r; j < (pair->cols - r); j++) {
+        // Get a mean-subtracted template and calculate disparity by NCC
+        get_template(i, j, left_float, t);
+        out_left[j] = disparity(t, right_float, magnitude_right, i, j, true, s);
+
+        get_template(i, j, right_float, t);
+        out_right[j] = disparity(t, left_float, magnitude_left, i, j, false, s);
+      }
+      report_row(*pair, i);
     }
-  }
+  });
+
+  if (options.left_right_check)
+    pair->check_left_right();
 
   return *this;
 }
@@ -1,15 +1,172 @@
 #pragma once
 #include "disparity-algorithm.h"
+#include <vector>
+
+/**
+ * How NCCDisparity evaluates the correlation.
+ *
+ * NCC_FILTER runs cv::filter2D over the search strip of every pixel.
+ *
+ * NCC_RUNNING_SUM keeps running window sums of the cross products for
+ * every disparity, so each (pixel, disparity) pair costs O(1) no matter
+ * how large the window is. It correlates the three colour channels as
+ * one vector of 3 * window_size^2 samples.
+ */
+enum NCCMode {
+  NCC_FILTER,
+  NCC_RUNNING_SUM
+};
+
+struct NCCOptions {
+  NCCMode mode = NCC_FILTER;
+
+  /**
+   * NCC_RUNNING_SUM only. The score of left pixel x at disparity d is the
+   * score of right pixel x - d at d, so evaluate the cost volume once and
+   * take both maps from it by winner-take-all along its two diagonals.
+   */
+  bool shared_volume = false;
+
+  /**
+   * Mark pixels occluded (0) when the other map does not send them back
+   * to within one disparity of where they started
+   */
+  bool left_right_check = false;
+
+  /**
+   * Pyramid levels below full resolution. With levels > 0 the pair is
+   * solved at 1 / 2^levels resolution in the chosen mode first, then
+   * each finer level only searches disparities within band of twice the
+   * coarser estimate, scored by the colour NCC.
+   */
+  int levels = 0;
+  int band = 2;
+};
 
 class NCCDisparity : public DisparityAlgorithm {
 private:
+  /**
+   * Buffers owned by one pool worker. They are sized once per compute
+   * from window_size and the image width, so matching pixels does not
+   * allocate.
+   */
+  struct Scratch {
+    /** Mean-subtracted template, one window_size^2 plane per channel */
+    std::vector<float> templ;
+    /** Search strip, one window_size x cols plane per channel */
+    std::vector<float> strip;
+    /** Correlation of one channel along the strip */
+    std::vector<float> sums;
+    /** Normalized correlation, averaged over the channels */
+    std::vector<float> detections;
+
+    /** Running-sum NCC: per disparity, column and channel window sums */
+    std::vector<float> col_sums;
+    /** col_sums with the channels added up */
+    std::vector<float> col_totals;
+    /** Window sums along the row for one disparity */
+    std::vector<float> windows;
+    /** Best score and disparity so far along the row */
+    std::vector<float> best;
+    std::vector<int> best_d;
+    /** Same for the target image when the volume is shared */
+    std::vector<float> target_best;
+    std::vector<int> target_best_d;
+  };
+  std::vector<Scratch> scratch;
+  void allocate_scratch();
+
+  /**
+   * Images a match works on, kept between calls so that matching another
+   * pair of the same size reuses them: the pair as floats, the window
+   * statistics of the running sums and the magnitudes of the filter
+   */
+  cv::Mat left_float, right_float;
+  cv::Mat mean_left, inv_std_left, mean_right, inv_std_right;
+  std::vector<cv::Mat> magnitude_left, magnitude_right;
+
   StereoPair *pair;
-  cv::Mat get_template(int i, int j, bool left);
-  cv::Mat get_row(int i, cv::Mat im);
-  cv::Mat get_magnitude(cv::Mat im);
-  int disparity(cv::Mat t, cv::Mat row, cv::Mat magnitude, int j, bool left);
+  void get_template(int i, int j, const cv::Mat &im, float *t);
+
+  /**
+   * Standard deviation of every window_size square of im, one plane per
+   * channel, with intermediate images kept in the members below
+   */
+  void get_magnitude(const cv::Mat &im, std::vector<cv::Mat> &planes);
+  cv::Mat im_sq, box_mean_sq, box_mean, box_sq_mean, variance, std_dev;
+  int disparity(const float *t, const cv::Mat &im, const std::vector<cv::Mat> &magnitude,
+    int i, int j, bool left, Scratch &s);
   int window_size;
+  NCCOptions options;
+
+  /*******************
+   * Running-sum NCC *
+   *******************/
+
+  /**
+   * Mean and inverse standard deviation of im over every window_size
+   * square, pooled over the colour channels. Flat windows get an inverse
+   * standard deviation of 0 so they never win a match.
+   */
+  void get_window_stats(const cv::Mat &im, cv::Mat &mean, cv::Mat &inv_std);
+  /** Sums of x and x^2 over the colour channels and the window rows, per column */
+  std::vector<double> stat_sums, stat_sq_sums;
+
+  /**
+   * One direction of the search: every pixel of ref is matched against
+   * target at column x - d (left) or x + d (right) for d in [min_d, max_d]
+   */
+  struct RunningSumSearch {
+    cv::Mat ref, target;
+    cv::Mat ref_mean, ref_inv_std;
+    cv::Mat target_mean, target_inv_std;
+    int min_d, max_d;
+    bool left;
+    cv::Mat disparity;
+
+    /**
+     * Shared volume: the map of target and its disparity range, filled in
+     * from the same scores. Left empty when target has a search of its own.
+     */
+    cv::Mat target_disparity;
+    int target_min_d, target_max_d;
+  };
+
+  /** Winner-take-all disparity of every row, split into bands across threads */
+  void running_sum_disparity(const RunningSumSearch &search);
+  /** Winner-take-all disparity of rows [row_begin, row_end) */
+  void running_sum_rows(const RunningSumSearch &search, int row_begin, int row_end, Scratch &s);
+
+  void compute_running_sum();
+
+  /***************
+   * NCC pyramid *
+   ***************/
+
+  /** Centred colour planes and window statistics of one pyramid level */
+  struct PyramidLevel {
+    std::vector<cv::Mat> left_planes, right_planes;
+    cv::Mat mean_left, inv_std_left;
+    cv::Mat mean_right, inv_std_right;
+  };
+
+  void compute_pyramid(StereoPair &full);
+
+  /**
+   * Disparity maps of pair searching only around the maps of the level
+   * below, which has half the resolution
+   */
+  void refine(const cv::Mat &coarse_left, const cv::Mat &coarse_right);
+
+  /**
+   * Best disparity of pixel (i, j) within band of twice the coarse guess,
+   * or over the whole range when the guess is occluded (0). Returns 0 if
+   * no candidate keeps the window inside the image.
+   */
+  int refine_pixel(const PyramidLevel &level, int i, int j, int guess, bool left,
+    Scratch &s);
 public:
-  NCCDisparity(int _window_size) : window_size(_window_size) {}
+  NCCDisparity(int _window_size, NCCOptions _options = NCCOptions()) :
+    window_size(_window_size), options(_options) {}
   NCCDisparity& compute(StereoPair &pair);
 };
@@ -0,0 +1,200 @@
+#include "pair-cache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace cv;
+using namespace std;
+
+/***** File layout *****/
+
+namespace {
+
+const char MAGIC[8] = {'S', 'T', 'P', 'A', 'I', 'R', '\n', '\0'};
+/** Bump whenever the layout or what a loaded pair holds changes */
+const uint32_t VERSION = 2;
+const int NUM_PLANES = 4;
+const size_t PLANE_ALIGN = 64;
+const int MAX_NAME = 64;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+
+  // What the file holds
+  char dataset[MAX_NAME];
+  int32_t illumination;
+  int32_t exposure;
+  float scale;
+
+  // The pair, other than its images
+  char name[MAX_NAME];
+  int32_t rows, cols;
+  int32_t base_offset;
+  int32_t min_disparity_left, max_disparity_left;
+  int32_t min_disparity_right, max_disparity_right;
+
+  // Left, right, true left and true right images
+  int32_t plane_type[NUM_PLANES];
+  uint64_t plane_offset[NUM_PLANES];
+  uint64_t file_size;
+};
+
+size_t align_up(size_t n) {
+  return (n + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+}
+
+size_t plane_size(int rows, int cols, int type) {
+  return (size_t) rows * cols * CV_ELEM_SIZE(type);
+}
+
+bool valid_type(int type) {
+  return type == CV_MAT_TYPE(type) && CV_MAT_DEPTH(type) <= CV_64F;
+}
+
+}
+
+/***** PairCache *****/
+
+PairCache::PairCache(string _dir) : dir(_dir) {
+  mkdir(dir.c_str(), 0755);
+}
+
+string PairCache::path(const string &dataset, int illumination, int exposure,
+    float scale) const {
+  char file[256];
+  snprintf(file, sizeof(file), "/%s-%d-%d-%g.pair",
+    dataset.c_str(), illumination, exposure, scale);
+  return dir + file;
+}
+
+bool PairCache::read(const string &dataset, int illumination, int exposure,
+    float scale, StereoPair &pair) const {
+  int fd = open(path(dataset, illumination, exposure, scale).c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  shared_ptr<void> storage(data, [size](void *p) { munmap(p, size); });
+
+  const Header &h = *(const Header *) data;
+  if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION
+      || h.header_size != sizeof(Header) || h.file_size != size)
+    return false;
+  if (strncmp(h.dataset, dataset.c_str(), MAX_NAME) != 0 || h.illumination != illumination
+      || h.exposure != exposure || h.scale != scale)
+    return false;
+  if (h.rows <= 0 || h.cols <= 0 || memchr(h.name, '\0', MAX_NAME) == nullptr)
+    return false;
+
+  Mat planes[NUM_PLANES];
+  for (int i = 0; i < NUM_PLANES; i++) {
+    int type = h.plane_type[i];
+    uint64_t offset = h.plane_offset[i];
+    if (!valid_type(type) || offset % PLANE_ALIGN != 0 || offset < sizeof(Header)
+        || offset > size || size - offset < plane_size(h.rows, h.cols, type))
+      return false;
+    planes[i] = Mat(h.rows, h.cols, type, (uchar *) data + offset);
+  }
+
+  pair.left = planes[0];
+  pair.right = planes[1];
+  pair.true_disparity_left = planes[2];
+  pair.true_disparity_right = planes[3];
+  pair.disparity_left = Mat();
+  pair.disparity_right = Mat();
+  pair.base_offset = h.base_offset;
+  pair.rows = h.rows;
+  pair.cols = h.cols;
+  pair.min_disparity_left = h.min_disparity_left;
+  pair.max_disparity_left = h.max_disparity_left;
+  pair.min_disparity_right = h.min_disparity_right;
+  pair.max_disparity_right = h.max_disparity_right;
+  pair.name = h.name;
+  pair.storage = storage;
+  return true;
+}
+
+bool PairCache::write(const string &dataset, int illumination, int exposure,
+    float scale, const StereoPair &pair) const {
+  const Mat *planes[NUM_PLANES] = {
+    &pair.left, &pair.right, &pair.true_disparity_left, &pair.true_disparity_right
+  };
+  if ((int) dataset.size() >= MAX_NAME || (int) pair.name.size() >= MAX_NAME)
+    return false;
+  for (const Mat *plane : planes)
+    if (plane->rows != pair.rows || plane->cols != pair.cols)
+      return false;
+
+  Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.version = VERSION;
+  h.header_size = sizeof(Header);
+  strncpy(h.dataset, dataset.c_str(), MAX_NAME - 1);
+  h.illumination = illumination;
+  h.exposure = exposure;
+  h.scale = scale;
+  strncpy(h.name, pair.name.c_str(), MAX_NAME - 1);
+  h.rows = pair.rows;
+  h.cols = pair.cols;
+  h.base_offset = pair.base_offset;
+  h.min_disparity_left = pair.min_disparity_left;
+  h.max_disparity_left = pair.max_disparity_left;
+  h.min_disparity_right = pair.min_disparity_right;
+  h.max_disparity_right = pair.max_disparity_right;
+
+  size_t offset = align_up(sizeof(Header));
+  for (int i = 0; i < NUM_PLANES; i++) {
+    h.plane_type[i] = planes[i]->type();
+    h.plane_offset[i] = offset;
+    offset = align_up(offset + plane_size(pair.rows, pair.cols, planes[i]->type()));
+  }
+  h.file_size = offset;
+
+  // Write to a name of our own and rename it into place, so concurrent
+  // runs and loader threads never map a file that is still being written
+  string final_path = path(dataset, illumination, exposure, scale);
+  stringstream tmp;
+  tmp << final_path << ".tmp-" << getpid() << "-" << hash<thread::id>()(this_thread::get_id());
+  string tmp_path = tmp.str();
+
+  ofstream out(tmp_path.c_str(), ios::binary | ios::trunc);
+  out.write((const char *) &h, sizeof(h));
+  const char zeros[PLANE_ALIGN] = {0};
+  size_t written = sizeof(h);
+  for (int i = 0; i < NUM_PLANES; i++) {
+    out.write(zeros, h.plane_offset[i] - written);
+    size_t row_size = (size_t) pair.cols * planes[i]->elemSize();
+    for (int y = 0; y < pair.rows; y++)
+      out.write((const char *) planes[i]->ptr(y), row_size);
+    written = h.plane_offset[i] + row_size * pair.rows;
+  }
+  out.write(zeros, h.file_size - written);
+  out.close();
+
+  if (!out || rename(tmp_path.c_str(), final_path.c_str()) != 0) {
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
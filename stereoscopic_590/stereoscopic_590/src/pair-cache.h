@@ -0,0 +1,44 @@
+#pragma once
+
+#include "stereo-pair.h"
+#include <string>
+
+/**
+ * Stereo pairs as they come out of loading and resizing, kept in one
+ * file each so later runs can map them instead of decoding the PNGs.
+ *
+ * A file holds a fixed header followed by the raw rows of the left and
+ * right images and of both ground truths, each plane starting on a
+ * 64 byte boundary. Reading maps the file privately, so the images of the
+ * pair view the mapping without a copy and writes to them stay in memory.
+ *
+ * Files are in the byte order of the machine that wrote them. Delete the
+ * directory after changing the dataset or the loading code.
+ */
+class PairCache {
+public:
+  /** Cache in directory dir, made if it does not exist yet */
+  explicit PairCache(std::string dir);
+
+  /**
+   * Fill pair from the file of the given pair and scale. Returns false,
+   * leaving pair alone, when there is no such file or it does not match
+   * this version and key.
+   */
+  bool read(const std::string &dataset, int illumination, int exposure,
+    float scale, StereoPair &pair) const;
+
+  /**
+   * Write pair as the file of the given pair and scale. The file only
+   * appears once it is complete, so readers never see half of one.
+   * Returns false if it could not be written.
+   */
+  bool write(const std::string &dataset, int illumination, int exposure,
+    float scale, const StereoPair &pair) const;
+
+private:
+  std::string dir;
+
+  std::string path(const std::string &dataset, int illumination, int exposure,
+    float scale) const;
+};
@@ -0,0 +1,100 @@
+#include "pair-loader.h"
+#include "thread-pool.h"
+
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+PairLoader::PairLoader(StereoDataset &_dataset, vector<string> _names,
+    float _scale, int _prefetch) :
+  dataset(_dataset),
+  names(_names),
+  scale(_scale),
+  prefetch(max(_prefetch, 0)),
+  next_load(0),
+  next_return(0),
+  stopping(false)
+{
+  // One thread per pair ahead, so that slow decodes overlap
+  int num_threads = min(prefetch, (int) names.size());
+  for (int i = 0; i < num_threads; i++)
+    threads.push_back(thread(&PairLoader::loader_loop, this));
+}
+
+PairLoader::~PairLoader() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  room.notify_all();
+  for (thread &t : threads)
+    t.join();
+}
+
+StereoPair PairLoader::load(int i) {
+  return dataset.get_scaled_pair(names[i], scale);
+}
+
+void PairLoader::loader_loop() {
+  // Loading only fills in the gaps in the algorithm's use of the cores
+  ThreadPool::run_serially_on_this_thread();
+
+  int n = names.size();
+  while (true) {
+    int i;
+    {
+      unique_lock<mutex> guard(lock);
+      room.wait(guard, [this, n]() {
+        return stopping || next_load >= n || next_load < next_return + prefetch;
+      });
+      if (stopping || next_load >= n)
+        return;
+      i = next_load++;
+    }
+
+    try {
+      StereoPair pair = load(i);
+      lock_guard<mutex> guard(lock);
+      ready.emplace(i, move(pair));
+    } catch (...) {
+      lock_guard<mutex> guard(lock);
+      failed[i] = current_exception();
+    }
+    loaded.notify_all();
+  }
+}
+
+bool PairLoader::has_next() const {
+  return next_return < (int) names.size();
+}
+
+StereoPair PairLoader::next() {
+  int i = next_return;
+  if (threads.empty()) {
+    next_return++;
+    return load(i);
+  }
+
+  unique_lock<mutex> guard(lock);
+  loaded.wait(guard, [this, i]() {
+    return ready.count(i) > 0 || failed.count(i) > 0;
+  });
+  next_return++;
+
+  map<int, exception_ptr>::iterator error = failed.find(i);
+  if (error != failed.end()) {
+    exception_ptr e = error->second;
+    failed.erase(error);
+    guard.unlock();
+    room.notify_all();
+    rethrow_exception(e);
+  }
+
+  map<int, StereoPair>::iterator it = ready.find(i);
+  StereoPair pair = move(it->second);
+  ready.erase(it);
+  guard.unlock();
+  room.notify_all();
+  return pair;
+}
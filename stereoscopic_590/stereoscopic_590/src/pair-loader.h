@@ -0,0 +1,60 @@
+#pragma once
+
+#include "stereo-dataset.h"
+
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Loads the pairs of a list of datasets in order, reading and resizing
+ * the ones after the current pair on background threads. The dataset's
+ * cache, if it has one, is used the same way.
+ *
+ * At most prefetch pairs are loaded or being loaded ahead of the one
+ * next() returns, so memory stays bounded however long the list is.
+ * With prefetch 0 next() loads each pair itself, when it is asked for.
+ */
+class PairLoader {
+public:
+  PairLoader(StereoDataset &dataset, std::vector<std::string> names,
+    float scale, int prefetch = 2);
+  ~PairLoader();
+
+  /** Whether next() has a pair left to return */
+  bool has_next() const;
+  /**
+   * The next pair, waiting for it to be loaded. Throws what loading the
+   * pair threw.
+   */
+  StereoPair next();
+
+private:
+  StereoDataset &dataset;
+  std::vector<std::string> names;
+  float scale;
+  int prefetch;
+
+  std::vector<std::thread> threads;
+
+  std::mutex lock;
+  /** Signalled when a pair is loaded */
+  std::condition_variable loaded;
+  /** Signalled when next() makes room for another pair, or on stopping */
+  std::condition_variable room;
+  /** Loaded pairs next() has not taken, by index in names */
+  std::map<int, StereoPair> ready;
+  /** What loading a pair threw instead, by index in names */
+  std::map<int, std::exception_ptr> failed;
+  /** Index of the next pair to start loading, and to return */
+  int next_load;
+  int next_return;
+  bool stopping;
+
+  StereoPair load(int i);
+  void loader_loop();
+};
@@ -0,0 +1,22 @@
+#include "preview-observer.h"
+#include "opencv2/highgui/highgui.hpp"
+
+// Disparities are small, so double them to make the maps visible. waitKey
+// only lets the windows redraw, it does not hold the algorithm back.
+
+void PreviewObserver::on_start(const StereoPair &pair) {
+  cv::imshow("Key", 2 * pair.true_disparity_left);
+  cv::waitKey(1);
+}
+
+void PreviewObserver::on_alpha(const StereoPair &pair, int alpha, bool changed) {
+  if (!changed)
+    return;
+  cv::imshow("WIP", 2 * pair.disparity_left);
+  cv::waitKey(1);
+}
+
+void PreviewObserver::on_iteration(const StereoPair &pair, int iteration, bool improved) {
+  cv::imshow("WIP", 2 * pair.disparity_left);
+  cv::waitKey(1);
+}
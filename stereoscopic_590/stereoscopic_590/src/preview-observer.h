@@ -0,0 +1,14 @@
+#pragma once
+#include "progress-observer.h"
+
+/**
+ * Shows the ground truth and the left disparity map as it is being
+ * worked out in highgui windows. Needs a display, and is only built when
+ * OpenCV has highgui.
+ */
+class PreviewObserver : public ProgressObserver {
+public:
+  void on_start(const StereoPair &pair);
+  void on_alpha(const StereoPair &pair, int alpha, bool changed);
+  void on_iteration(const StereoPair &pair, int iteration, bool improved);
+};
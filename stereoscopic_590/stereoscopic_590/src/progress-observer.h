@@ -0,0 +1,27 @@
+#pragma once
+#include "stereo-pair.h"
+
+/**
+ * Told how far a DisparityAlgorithm has got. Every callback does nothing
+ * by default, so an observer only overrides what it wants to hear about.
+ */
+class ProgressObserver {
+public:
+  virtual ~ProgressObserver() {}
+
+  /** Before the algorithm starts on pair */
+  virtual void on_start(const StereoPair &pair) {}
+
+  /**
+   * After a row of both disparity maps has been written. Rows are done
+   * in parallel, so this is called from the pool's worker threads in no
+   * particular order.
+   */
+  virtual void on_row(const StereoPair &pair, int row) {}
+
+  /** Graph cut, after the expansion of alpha (a disparity) */
+  virtual void on_alpha(const StereoPair &pair, int alpha, bool changed) {}
+
+  /** Graph cut, after a pass of expansions over every disparity */
+  virtual void on_iteration(const StereoPair &pair, int iteration, bool improved) {}
+};
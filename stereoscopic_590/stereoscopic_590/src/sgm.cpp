@@ -0,0 +1,365 @@
+#include "sgm.h"
+#include "census.h"
+#include "census-kernels.h"
+#include "thread-pool.h"
+#include <algorithm>
+#include <limits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+/** Path costs saturate here, which keeps them valid as signed 16 bit */
+static const int MAX_PATH_COST = 0x7fff;
+/** Cost of the padding disparities, above any real one */
+static const int PADDING_COST = 0x3fff;
+
+/************************
+ * Path cost recurrence *
+ ************************/
+
+/**
+ * One step of a path: out(d) for the n disparities of a pixel, given the
+ * path costs prev(d) at the previous pixel and their minimum. prev and out
+ * point at disparity 0 of buffers with a MAX_PATH_COST sentinel on either
+ * side. out is also added to sum. n is a multiple of 8.
+ *
+ * Returns the minimum of out.
+ */
+static inline int path_step(const uint16_t *c, const uint16_t *prev, int prev_min,
+    uint16_t *out, uint16_t *sum, int n, int P1, int P2) {
+#ifdef __SSE2__
+  __m128i p1 = _mm_set1_epi16(P1);
+  __m128i jump = _mm_set1_epi16(min(prev_min + P2, MAX_PATH_COST));
+  __m128i base = _mm_set1_epi16(prev_min);
+  __m128i out_min = _mm_set1_epi16(MAX_PATH_COST);
+
+  for (int d = 0; d < n; d += 8) {
+    __m128i same = _mm_loadu_si128((const __m128i*) (prev + d));
+    __m128i below = _mm_loadu_si128((const __m128i*) (prev + d - 1));
+    __m128i above = _mm_loadu_si128((const __m128i*) (prev + d + 1));
+
+    __m128i step = _mm_adds_epi16(_mm_min_epi16(below, above), p1);
+    __m128i best = _mm_min_epi16(_mm_min_epi16(same, step), jump);
+
+    __m128i l = _mm_adds_epi16(_mm_loadu_si128((const __m128i*) (c + d)),
+      _mm_sub_epi16(best, base));
+    _mm_storeu_si128((__m128i*) (out + d), l);
+    out_min = _mm_min_epi16(out_min, l);
+
+    __m128i s = _mm_loadu_si128((const __m128i*) (sum + d));
+    _mm_storeu_si128((__m128i*) (sum + d), _mm_adds_epu16(s, l));
+  }
+
+  // Minimum of the eight lanes
+  out_min = _mm_min_epi16(out_min, _mm_srli_si128(out_min, 8));
+  out_min = _mm_min_epi16(out_min, _mm_srli_si128(out_min, 4));
+  out_min = _mm_min_epi16(out_min, _mm_srli_si128(out_min, 2));
+  return (uint16_t) _mm_cvtsi128_si32(out_min);
+#else
+  int jump = min(prev_min + P2, MAX_PATH_COST);
+  int out_min = MAX_PATH_COST;
+
+  for (int d = 0; d < n; d++) {
+    int step = min((int) min(prev[d - 1], prev[d + 1]) + P1, MAX_PATH_COST);
+    int best = min(min((int) prev[d], step), jump);
+    int l = min(c[d] + best - prev_min, MAX_PATH_COST);
+    out[d] = l;
+    out_min = min(out_min, l);
+    sum[d] = min(sum[d] + l, 0xffff);
+  }
+  return out_min;
+#endif
+}
+
+/**
+ * Path costs of one direction for some pixels: n disparities plus a
+ * sentinel either side per pixel, and the minimum per pixel
+ */
+struct PathBuffer {
+  vector<uint16_t> costs;
+  vector<int> mins;
+  int stride;
+
+  void allocate(int num_pixels, int num_d) {
+    stride = num_d + 2;
+    costs.assign(num_pixels * stride, MAX_PATH_COST);
+    mins.assign(num_pixels, 0);
+  }
+  /** Disparity 0 of pixel i */
+  uint16_t* at(int i) {
+    return &costs[i * stride + 1];
+  }
+};
+
+/***************
+ * Cost volume *
+ ***************/
+
+template <typename T>
+void SGMDisparity::compute_cost() {
+  vector<T> left, right;
+  census_transform(get_gray8(pair->left), options.census_size, left);
+  census_transform(get_gray8(pair->right), options.census_size, right);
+
+  int rows = pair->rows;
+  int cols = pair->cols;
+  int cr = options.census_size / 2;
+  // Matches without a full census square on both sides cost as much as
+  // the worst real one
+  int invalid_cost = options.census_size * options.census_size - 1;
+
+  cost.resize((size_t) rows * cols * num_d_padded);
+
+  ThreadPool &pool = ThreadPool::shared();
+  vector<vector<int> > distances(pool.concurrency(), vector<int>(cols));
+
+  pool.parallel_for(rows, 8,
+      [this, &left, &right, &distances, rows, cols, cr, invalid_cost]
+      (int begin, int end, int worker) {
+    const CensusKernels &kernels = census_kernels();
+    vector<int> &distance = distances[worker];
+
+    for (int y = begin; y < end; y++) {
+      uint16_t *row = &cost[(size_t) y * cols * num_d_padded];
+      for (int x = 0; x < cols; x++) {
+        uint16_t *c = row + x * num_d_padded;
+        fill(c, c + num_d, invalid_cost);
+        fill(c + num_d, c + num_d_padded, PADDING_COST);
+      }
+      if (y < cr || y >= rows - cr)
+        continue;
+
+      for (int k = 0; k < num_d; k++) {
+        int d = min_d + k;
+        // Left columns x with descriptors at both x and x - d
+        int c_min = max(cr, cr + d);
+        int c_max = min(cols - cr, cols - cr + d);
+        if (c_max <= c_min)
+          continue;
+
+        fill(distance.begin() + c_min, distance.begin() + c_max, 0);
+        hamming_add(kernels, &left[y * cols + c_min], &right[y * cols + c_min - d],
+          &distance[c_min], c_max - c_min);
+        for (int x = c_min; x < c_max; x++)
+          row[x * num_d_padded + k] = distance[x];
+      }
+    }
+  });
+}
+
+/********************
+ * Path aggregation *
+ ********************/
+
+vector<SGMDisparity::Direction> SGMDisparity::get_directions() {
+  vector<Direction> directions = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+  if (options.paths >= 8) {
+    directions.insert(directions.end(), {{1, 1}, {-1, 1}, {1, -1}, {-1, -1}});
+  }
+  if (options.paths >= 16) {
+    directions.insert(directions.end(), {
+      {1, 2}, {-1, 2}, {2, 1}, {-2, 1},
+      {1, -2}, {-1, -2}, {2, -1}, {-2, -1}});
+  }
+  return directions;
+}
+
+void SGMDisparity::aggregate_horizontal() {
+  int cols = pair->cols;
+  int n = num_d_padded;
+
+  // Path start: no previous costs to add
+  PathBuffer start;
+  start.allocate(1, n);
+  fill(start.at(0), start.at(0) + n, 0);
+
+  ThreadPool &pool = ThreadPool::shared();
+  vector<PathBuffer> buffers(pool.concurrency());
+  for (PathBuffer &b : buffers)
+    b.allocate(2, n);
+
+  pool.parallel_for(pair->rows, 4,
+      [this, &start, &buffers, cols, n](int begin, int end, int worker) {
+    PathBuffer &b = buffers[worker];
+    for (int y = begin; y < end; y++) {
+      const uint16_t *c = &cost[(size_t) y * cols * n];
+      uint16_t *sum = &aggregated[(size_t) y * cols * n];
+
+      // Left to right, then right to left
+      for (int dx = 1; dx >= -1; dx -= 2) {
+        const uint16_t *prev = start.at(0);
+        int prev_min = 0;
+        for (int i = 0; i < cols; i++) {
+          int x = (dx > 0) ? i : cols - 1 - i;
+          uint16_t *out = b.at(i & 1);
+          prev_min = path_step(c + x * n, prev, prev_min, out, sum + x * n, n, P1, P2);
+          prev = out;
+        }
+      }
+    }
+  });
+}
+
+void SGMDisparity::aggregate_vertical(const vector<Direction> &directions) {
+  int rows = pair->rows;
+  int cols = pair->cols;
+  int n = num_d_padded;
+
+  PathBuffer start;
+  start.allocate(1, n);
+  fill(start.at(0), start.at(0) + n, 0);
+
+  // Path costs of the last three rows per direction, enough for dy = 2
+  vector<PathBuffer> rings(directions.size());
+  for (PathBuffer &ring : rings)
+    ring.allocate(3 * cols, n);
+
+  // Rank of each direction among those with the same sign of dy
+  vector<int> rank(directions.size());
+  int num_down = 0, num_up = 0;
+  for (size_t p = 0; p < directions.size(); p++)
+    rank[p] = (directions[p].dy > 0) ? num_down++ : num_up++;
+  int per_side = max(num_down, num_up);
+
+  // Direction p takes its k-th band in step 2 * rank[p] + k, counting
+  // bands from the top going down and from the bottom going up. Two
+  // directions going the same way are then two bands apart, and with an
+  // even number of bands one going down and one going up never meet.
+  // Eight bands per direction keep the start and end of the pipeline,
+  // when some directions wait, short. The sums saturate, so the order
+  // the directions add in does not change them.
+  int num_bands = min(8 * per_side, (rows + 1) / 2 * 2);
+  int num_steps = num_bands + 2 * (per_side - 1);
+
+  ThreadPool &pool = ThreadPool::shared();
+  for (int step = 0; step < num_steps; step++) {
+    pool.parallel_for(directions.size(), 1,
+        [this, &directions, &rings, &rank, &start, step, num_bands, rows, cols, n]
+        (int begin, int end, int) {
+      for (int p = begin; p < end; p++) {
+        int k = step - 2 * rank[p];
+        if (k < 0 || k >= num_bands)
+          continue;
+        const Direction &direction = directions[p];
+        PathBuffer &ring = rings[p];
+        bool down = direction.dy > 0;
+        int band = down ? k : num_bands - 1 - k;
+        int band_begin = band * rows / num_bands;
+        int band_end = (band + 1) * rows / num_bands;
+
+        for (int i = band_begin; i < band_end; i++) {
+          int y = down ? i : band_begin + band_end - 1 - i;
+          int py = y - direction.dy;
+          const uint16_t *c = &cost[(size_t) y * cols * n];
+          uint16_t *sum = &aggregated[(size_t) y * cols * n];
+
+          // Pixels of a row only depend on earlier rows
+          for (int x = 0; x < cols; x++) {
+            int px = x - direction.dx;
+            const uint16_t *prev = start.at(0);
+            int prev_min = 0;
+            if (px >= 0 && px < cols && py >= 0 && py < rows) {
+              int prev_index = (py % 3) * cols + px;
+              prev = ring.at(prev_index);
+              prev_min = ring.mins[prev_index];
+            }
+
+            int index = (y % 3) * cols + x;
+            ring.mins[index] = path_step(c + x * n, prev, prev_min, ring.at(index),
+              sum + x * n, n, P1, P2);
+          }
+        }
+      }
+    });
+  }
+}
+
+/***********************
+ * Disparity selection *
+ ***********************/
+
+void SGMDisparity::select_disparities() {
+  int rows = pair->rows;
+  int cols = pair->cols;
+  int cr = options.census_size / 2;
+  int n = num_d_padded;
+
+  ThreadPool::shared().parallel_for(rows - 2 * cr, 8,
+      [this, rows, cols, cr, n](int begin, int end, int) {
+    for (int y = cr + begin; y < cr + end; y++) {
+      const uint16_t *s = &aggregated[(size_t) y * cols * n];
+      uchar *out_left = pair->disparity_left.ptr<uchar>(y);
+      uchar *out_right = pair->disparity_right.ptr<uchar>(y);
+
+      for (int x = cr; x < cols - cr; x++) {
+        // right = left - disparity
+        int best = numeric_limits<int>::max();
+        int d_max = min(pair->max_disparity_left, x - cr);
+        for (int d = max(pair->min_disparity_left, min_d); d <= d_max; d++) {
+          int total = s[x * n + d - min_d];
+          if (total < best) {
+            best = total;
+            out_left[x] = d;
+          }
+        }
+
+        // left = right + disparity, so right pixel x sits at x + d in
+        // the volume of the left image
+        best = numeric_limits<int>::max();
+        d_max = min(pair->max_disparity_right, cols - cr - 1 - x);
+        for (int d = max(pair->min_disparity_right, min_d); d <= d_max; d++) {
+          int total = s[(x + d) * n + d - min_d];
+          if (total < best) {
+            best = total;
+            out_right[x] = d;
+          }
+        }
+      }
+      report_row(*pair, y);
+    }
+  });
+}
+
+SGMDisparity& SGMDisparity::compute(StereoPair &_pair) {
+  pair = &_pair;
+  report_start(*pair);
+
+  pair->disparity_left = cv::Mat(pair->rows, pair->cols, CV_8U);
+  pair->disparity_right = cv::Mat(pair->rows, pair->cols, CV_8U);
+
+  pair->disparity_left.setTo(0);
+  pair->disparity_right.setTo(0);
+
+  min_d = max(0, min(pair->min_disparity_left, pair->min_disparity_right));
+  num_d = max(pair->max_disparity_left, pair->max_disparity_right) - min_d + 1;
+  if (num_d <= 0)
+    return *this;
+  num_d_padded = (num_d + 7) / 8 * 8;
+
+  // Every neighbour but the centre takes a bit
+  if (options.census_size * options.census_size - 1 <= 32) {
+    compute_cost<uint32_t>();
+  } else {
+    compute_cost<uint64_t>();
+  }
+
+  aggregated.assign(cost.size(), 0);
+  aggregate_horizontal();
+
+  vector<Direction> vertical;
+  for (Direction &direction : get_directions()) {
+    if (direction.dy != 0)
+      vertical.push_back(direction);
+  }
+  aggregate_vertical(vertical);
+
+  select_disparities();
+
+  if (options.left_right_check)
+    pair->check_left_right();
+
+  return *this;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "disparity-algorithm.h"
+#include <cstdint>
+#include <vector>
+
+struct SGMOptions {
+  /** Scan directions summed per pixel: 4, 8 or 16 */
+  int paths = 8;
+
+  /** Side of the census square behind the matching cost, 3, 5 or 7 */
+  int census_size = 5;
+
+  /**
+   * Mark pixels occluded (0) when the other map does not send them back
+   * to within one disparity of where they started
+   */
+  bool left_right_check = false;
+};
+
+/**
+ * Semi-global matching over census Hamming costs.
+ *
+ * Along every scan direction r the cost of disparity d at pixel p is
+ *
+ *   L_r(p, d) = C(p, d) + min(L_r(p - r, d),
+ *                             L_r(p - r, d +- 1) + P1,
+ *                             min_k L_r(p - r, k) + P2) - min_k L_r(p - r, k)
+ *
+ * and the disparity is the winner-take-all of the sum over directions.
+ * P1 penalizes steps of one disparity and P2 larger jumps, which gives
+ * smooth surfaces with sharp edges at a cost close to local matching.
+ */
+class SGMDisparity : public DisparityAlgorithm {
+private:
+  StereoPair *pair;
+  int P1;
+  int P2;
+  SGMOptions options;
+
+  /** First disparity of the volume, which covers both maps */
+  int min_d;
+  int num_d;
+  /** num_d plus padding up to whole SIMD vectors */
+  int num_d_padded;
+
+  /**
+   * Matching cost of every pixel of the left image and disparity, with
+   * the disparities of a pixel next to each other. Costs stay below
+   * 0x8000 so the SIMD code can treat them as signed.
+   */
+  std::vector<uint16_t> cost;
+  /** Path costs summed over all directions, laid out like cost */
+  std::vector<uint16_t> aggregated;
+
+  template <typename T>
+  void compute_cost();
+
+  /** A scan direction: each pixel continues the path from (x - dx, y - dy) */
+  struct Direction {
+    int dx, dy;
+  };
+  std::vector<Direction> get_directions();
+
+  /** Directions along rows. Rows are independent, so they run in parallel. */
+  void aggregate_horizontal();
+
+  /**
+   * Directions that move between rows. Each direction sweeps the rows on
+   * its own, one band of rows at a time, and the directions run side by
+   * side, staggered so that no two of them add to the same band at once.
+   */
+  void aggregate_vertical(const std::vector<Direction> &directions);
+
+  /** Winner-take-all along the two diagonals of the aggregated volume */
+  void select_disparities();
+
+public:
+  SGMDisparity(int _P1, int _P2, SGMOptions _options = SGMOptions()) :
+    P1(_P1), P2(_P2), options(_options) {}
+  SGMDisparity& compute(StereoPair &pair);
+};
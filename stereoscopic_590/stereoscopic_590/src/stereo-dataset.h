@@ -1,6 +1,8 @@
 #pragma once
 
 #include "stereo-pair.h"
+#include "pair-cache.h"
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -11,12 +13,25 @@ private:
   const char *true_left_format = "./data/%s/disp1.png";
   const char *true_right_format = "./data/%s/disp5.png";
   const char *offset_format = "./data/%s/dmin.txt";
+  std::unique_ptr<PairCache> cache;
 public:
   StereoPair get_stereo_pair(
     const std::string dataset = "Bowling1",
     int illumination=1,
     int exposure=1);
 
+  /** Keep the pairs get_scaled_pair loads in a PairCache in dir */
+  void set_cache_dir(const std::string dir);
+  /**
+   * get_stereo_pair resized by scale. With a cache the pair is mapped
+   * from it, or loaded and then saved there if it was not in it yet.
+   */
+  StereoPair get_scaled_pair(
+    const std::string dataset,
+    float scale,
+    int illumination=1,
+    int exposure=1);
+
   std::vector<std::string> get_all_datasets();
   std::vector<int> get_all_illuminations();
   std::vector<int> get_all_exposures();
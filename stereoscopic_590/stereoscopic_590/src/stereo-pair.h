@@ -1,10 +1,12 @@
 #pragma once
 
 #include "opencv2/core/core.hpp"
+#include <memory>
 #include <string>
 
 class StereoPair {
 public:
+  /** CV_8UC3, as decoded. Algorithms that need floats convert them. */
   cv::Mat left, right;
   cv::Mat true_disparity_left, true_disparity_right;
   cv::Mat disparity_left, disparity_right;
@@ -16,9 +18,21 @@ public:
 
   std::string name;
 
+  /** Memory the images view, when they were mapped from a PairCache file */
+  std::shared_ptr<void> storage;
+
   void resize(float scale);
 
+  /**
+   * Mark pixels of disparity_left and disparity_right occluded (0) when
+   * the other map does not send them back to within tolerance of where
+   * they started
+   */
+  void check_left_right(int tolerance = 1);
+
   StereoPair(cv::Mat _left, cv::Mat _right,
     cv::Mat _true_left, cv::Mat _true_right,
     int _base_offset, std::string _name);
+  /** An empty pair, for a PairCache to fill in */
+  StereoPair();
 };
\ No newline at end of file
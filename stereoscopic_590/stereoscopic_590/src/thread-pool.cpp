@@ -0,0 +1,168 @@
+#include "thread-pool.h"
+#include <algorithm>
+
+using namespace std;
+
+/** Set on pool threads and on a caller while it runs its own chunks */
+static thread_local bool inside_pool = false;
+
+static mutex shared_pool_lock;
+static unique_ptr<ThreadPool> shared_pool;
+
+ThreadPool::ThreadPool(int num_threads) :
+  job(nullptr),
+  job_n(0),
+  job_grain(1),
+  generation(0),
+  running(0),
+  stopping(false)
+{
+  if (num_threads <= 0)
+    num_threads = thread::hardware_concurrency();
+  if (num_threads <= 0)
+    num_threads = 1;
+
+  for (int i = 0; i < num_threads; i++)
+    queues.push_back(unique_ptr<ChunkQueue>(new ChunkQueue()));
+
+  // The caller of parallel_for is worker 0
+  for (int i = 1; i < num_threads; i++)
+    threads.push_back(thread(&ThreadPool::worker_loop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(state_lock);
+    stopping = true;
+  }
+  wake_workers.notify_all();
+  for (thread &t : threads)
+    t.join();
+}
+
+int ThreadPool::concurrency() const {
+  return threads.size() + 1;
+}
+
+void ThreadPool::parallel_for(int n, int grain, const RangeFunction &fn) {
+  if (n <= 0)
+    return;
+  if (grain < 1)
+    grain = 1;
+  int num_chunks = (n + grain - 1) / grain;
+
+  if (threads.empty() || num_chunks == 1 || inside_pool || !job_lock.try_lock()) {
+    for (int begin = 0; begin < n; begin += grain)
+      fn(begin, min(n, begin + grain), 0);
+    return;
+  }
+
+  // Deal the chunks out evenly
+  int num_workers = concurrency();
+  for (int w = 0; w < num_workers; w++) {
+    queues[w]->begin = (long) num_chunks * w / num_workers;
+    queues[w]->end = (long) num_chunks * (w + 1) / num_workers;
+  }
+
+  {
+    lock_guard<mutex> lock(state_lock);
+    job = &fn;
+    job_n = n;
+    job_grain = grain;
+    running = threads.size();
+    generation++;
+  }
+  wake_workers.notify_all();
+
+  inside_pool = true;
+  run_chunks(0);
+  inside_pool = false;
+
+  {
+    unique_lock<mutex> lock(state_lock);
+    job_done.wait(lock, [this] { return running == 0; });
+    job = nullptr;
+  }
+  job_lock.unlock();
+}
+
+void ThreadPool::worker_loop(int worker) {
+  inside_pool = true;
+  long seen = 0;
+  while (true) {
+    {
+      unique_lock<mutex> lock(state_lock);
+      wake_workers.wait(lock, [this, seen] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+    }
+
+    run_chunks(worker);
+
+    {
+      lock_guard<mutex> lock(state_lock);
+      if (--running == 0)
+        job_done.notify_one();
+    }
+  }
+}
+
+void ThreadPool::run_chunks(int worker) {
+  int chunk;
+  while (pop_chunk(worker, chunk) || (steal_chunks(worker) && pop_chunk(worker, chunk))) {
+    int begin = chunk * job_grain;
+    (*job)(begin, min(job_n, begin + job_grain), worker);
+  }
+}
+
+bool ThreadPool::pop_chunk(int worker, int &chunk) {
+  ChunkQueue &queue = *queues[worker];
+  lock_guard<mutex> lock(queue.lock);
+  if (queue.begin >= queue.end)
+    return false;
+  chunk = queue.begin++;
+  return true;
+}
+
+bool ThreadPool::steal_chunks(int worker) {
+  int num_workers = queues.size();
+  for (int i = 1; i < num_workers; i++) {
+    ChunkQueue &victim = *queues[(worker + i) % num_workers];
+
+    // Take the back half of whatever the victim has left
+    int begin, end;
+    {
+      lock_guard<mutex> lock(victim.lock);
+      int remaining = victim.end - victim.begin;
+      if (remaining <= 0)
+        continue;
+      end = victim.end;
+      begin = end - (remaining + 1) / 2;
+      victim.end = begin;
+    }
+
+    ChunkQueue &own = *queues[worker];
+    lock_guard<mutex> lock(own.lock);
+    own.begin = begin;
+    own.end = end;
+    return true;
+  }
+  return false;
+}
+
+ThreadPool& ThreadPool::shared() {
+  lock_guard<mutex> lock(shared_pool_lock);
+  if (!shared_pool)
+    shared_pool.reset(new ThreadPool());
+  return *shared_pool;
+}
+
+void ThreadPool::run_serially_on_this_thread() {
+  inside_pool = true;
+}
+
+void ThreadPool::set_shared_concurrency(int num_threads) {
+  lock_guard<mutex> lock(shared_pool_lock);
+  shared_pool.reset(new ThreadPool(num_threads));
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads shared by the algorithms.
+ *
+ * parallel_for deals the chunks of a range out evenly to the workers up
+ * front. A worker that runs out of chunks steals half of the chunks
+ * another worker has left, so rows of uneven cost still balance.
+ */
+class ThreadPool {
+public:
+  typedef std::function<void(int begin, int end, int worker)> RangeFunction;
+
+  /** num_threads <= 0 uses one thread per hardware core */
+  explicit ThreadPool(int num_threads = 0);
+  ~ThreadPool();
+
+  /** Number of threads taking part in a parallel_for, the caller included */
+  int concurrency() const;
+
+  /**
+   * Call fn(begin, end, worker) on chunks of at most grain indices that
+   * together cover [0, n), and wait until all of them are done.
+   *
+   * worker lies in [0, concurrency()) and a worker runs one chunk at a
+   * time, so it can index per-thread scratch space.
+   *
+   * Nested calls, and calls made while another thread has the pool busy,
+   * run serially on the calling thread as worker 0.
+   */
+  void parallel_for(int n, int grain, const RangeFunction &fn);
+
+  /** The pool used by all algorithms */
+  static ThreadPool& shared();
+  /** Resize the shared pool. Only call this while it is idle. */
+  static void set_shared_concurrency(int num_threads);
+  /**
+   * Run every later parallel_for of the calling thread serially on it,
+   * so a background thread never takes the workers from the algorithms
+   */
+  static void run_serially_on_this_thread();
+
+private:
+  /** Chunks [begin, end) a worker still has to run */
+  struct ChunkQueue {
+    std::mutex lock;
+    int begin;
+    int end;
+  };
+
+  std::vector<std::thread> threads;
+  std::vector<std::unique_ptr<ChunkQueue> > queues;
+
+  /** Held by the caller for the whole parallel_for */
+  std::mutex job_lock;
+
+  std::mutex state_lock;
+  std::condition_variable wake_workers;
+  std::condition_variable job_done;
+  const RangeFunction *job;
+  int job_n;
+  int job_grain;
+  long generation;
+  int running;
+  bool stopping;
+
+  void worker_loop(int worker);
+  void run_chunks(int worker);
+  bool pop_chunk(int worker, int &chunk);
+  bool steal_chunks(int worker);
+};
@@ -0,0 +1,154 @@
+// Checks that matching another pair of the same size with NCC, in filter
+// mode and in running-sum mode with separate and shared volumes, makes a
+// fixed number of allocations however large the pair: none per pixel or
+// per row.
+//
+// Every heap allocation goes through malloc and its relatives, which the
+// test replaces with counting ones, so it needs glibc to forward to.
+
+#include "../src/ncc.h"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef __GLIBC__
+
+static std::atomic<long> allocations(0);
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *p);
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  allocations++;
+  return __libc_realloc(p, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  allocations++;
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  allocations++;
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size) {
+  allocations++;
+  *p = __libc_memalign(alignment, size);
+  return (*p != nullptr || size == 0) ? 0 : ENOMEM;
+}
+
+void free(void *p) {
+  __libc_free(p);
+}
+
+}
+
+/** A pair of random images of the given size, with the right one shifted */
+static StereoPair make_pair(int rows, int cols) {
+  StereoPair pair;
+  pair.left = cv::Mat(rows, cols, CV_8UC3);
+  pair.right = cv::Mat(rows, cols, CV_8UC3);
+  srand(rows);
+  for (int y = 0; y < rows; y++) {
+    uchar *left = pair.left.ptr<uchar>(y);
+    uchar *right = pair.right.ptr<uchar>(y);
+    for (int x = 0; x < 3 * cols; x++)
+      left[x] = rand() % 256;
+    for (int x = 0; x < 3 * cols; x++)
+      right[x] = x < 3 * (cols - 8) ? left[x + 3 * 8] : 0;
+  }
+  pair.rows = rows;
+  pair.cols = cols;
+  pair.min_disparity_left = pair.min_disparity_right = 4;
+  pair.max_disparity_left = pair.max_disparity_right = 16;
+  pair.name = "random";
+  return pair;
+}
+
+/** Allocations made by the second of two matches of a pair */
+static long second_match(NCCDisparity &ncc, int rows, int cols) {
+  StereoPair pair = make_pair(rows, cols);
+  ncc.compute(pair);
+  long before = allocations;
+  ncc.compute(pair);
+  return allocations - before;
+}
+
+/** Allocations made by a cv::boxFilter into an image it has filled before */
+static long box_filter_allocations(int rows, int cols) {
+  cv::Mat src(rows, cols, CV_32FC3), dst;
+  for (int y = 0; y < rows; y++)
+    for (int x = 0; x < 3 * cols; x++)
+      src.ptr<float>(y)[x] = rand() % 256;
+  cv::boxFilter(src, dst, -1, cv::Size(5, 5), cv::Point(-1, -1), true, cv::BORDER_CONSTANT);
+  long before = allocations;
+  cv::boxFilter(src, dst, -1, cv::Size(5, 5), cv::Point(-1, -1), true, cv::BORDER_CONSTANT);
+  return allocations - before;
+}
+
+int main() {
+  struct Case {
+    const char *name;
+    NCCMode mode;
+    bool shared;
+  };
+  const Case cases[] = {
+    {"filter", NCC_FILTER, false},
+    {"running-sum separate volume", NCC_RUNNING_SUM, false},
+    {"running-sum shared volume", NCC_RUNNING_SUM, true},
+  };
+
+  bool ok = true;
+  for (const Case &c : cases) {
+    NCCOptions options;
+    options.mode = c.mode;
+    options.shared_volume = c.shared;
+    options.left_right_check = false;
+    NCCDisparity ncc(5, options);
+
+    // What is left per call: the two maps and the jobs handed to the
+    // thread pool, at most 8 together. The filter mode also runs four
+    // box filters for the window magnitudes, two per image, and OpenCV
+    // sets up row buffers for each.
+    long bound = 8;
+    if (c.mode == NCC_FILTER)
+      bound += 4 * box_filter_allocations(240, 320);
+
+    long small = second_match(ncc, 60, 80);
+    long large = second_match(ncc, 240, 320);
+    bool passed = small == large && large <= bound;
+    printf("%s: %ld allocations for 60x80, %ld for 240x320, at most %ld: %s\n",
+      c.name, small, large, bound, passed ? "ok" : "FAILED");
+    ok = ok && passed;
+  }
+  return ok ? 0 : 1;
+}
+
+#else
+
+int main() {
+  printf("skipped: counting allocations needs glibc\n");
+  return 0;
+}
+
+#endif